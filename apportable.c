@@ -36,6 +36,7 @@
 # include <mach-o/dyld.h>
 # include <mach-o/nlist.h>
 # include <sys/syslimits.h>
+# include <dlfcn.h>
 # include <iconv.h>
 # ifdef __LP64__
 typedef struct mach_header_64 mach_header_t;
@@ -63,6 +64,19 @@ typedef struct nlist nlist_t;
 #  include <link.h>
 #  include <dlfcn.h>
 #  include <iconv.h>
+#  include <sched.h>
+#  include <sys/auxv.h>
+#  define APPORTABLE_PROGCACHE   /* loader generation from dl_iterate_phdr */
+#  if defined __has_include
+#   if __has_include(<linux/io_uring.h>)
+#    include <linux/io_uring.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    if defined __NR_io_uring_setup
+#     define APPORTABLE_URING   /* batched probes for whereis */
+#    endif
+#   endif
+#  endif
 # endif
 
 #elif defined __UCLIBC__
@@ -87,7 +101,9 @@ typedef struct nlist nlist_t;
 #endif
 
 
+#include <limits.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <wchar.h>
@@ -96,6 +112,11 @@ typedef struct nlist nlist_t;
 # include <io.h>
 #else
 #include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/utsname.h>
+#include <pthread.h>
 #endif
 #include <sys/stat.h>
 
@@ -104,9 +125,117 @@ typedef struct nlist nlist_t;
 
 #include "apportable.h"
 
-#define mem_calloc(a, t, c) (a)->_calloc((c), sizeof(t))
-#define mem_free(a, v) (a)->_free((v))
-#define APPORTABLE_STATE(a) apportable_getstate((a))
+/* allocations for results and temporaries, served by an arena if attached;
+ * anything that outlives a call must use a->_calloc / a->_free directly */
+#define mem_calloc(a, t, c) apportable_calloc((a), (c), sizeof(t))
+#define mem_free(a, v) apportable_free((a), (v))
+#if !defined APPORTABLE_STATS
+# define APPORTABLE_STATE(a) apportable_getstate((a))
+#else
+/* Every API function opens with "self = APPORTABLE_STATE(a);", which here
+ * also declares the call in progress: for the thread, until the function
+ * returns, allocations are attributed to it (to the outermost one if
+ * they nest) and counted on self.  See apportable_stats_enable. */
+# if !defined __GNUC__
+#  error "APPORTABLE_STATS needs GCC or Clang"
+# endif
+struct apportable_call
+{
+    apportable self;
+    const char * fn;
+};
+static struct apportable_call _apportable_stats_enter (apportable self, const char * fn);
+static void _apportable_stats_leave (struct apportable_call * prev);
+# define APPORTABLE_STATE(a) apportable_getstate((a)); \
+    struct apportable_call _apportable_call_prev __attribute__((cleanup(_apportable_stats_leave))) \
+        = _apportable_stats_enter(apportable_getstate((a)), __func__)
+#endif
+
+/* minimal lock word, usable without initialization ({0} is unlocked) */
+#if defined _WIN32
+# define apportable_trylock(l) (InterlockedExchange((l), 1) == 0)
+# define apportable_unlock(l) InterlockedExchange((l), 0)
+# define apportable_yield() SwitchToThread()
+#else
+# define apportable_trylock(l) (__sync_lock_test_and_set((l), 1) == 0)
+# define apportable_unlock(l) __sync_lock_release((l))
+# define apportable_yield() sched_yield()
+#endif
+
+/* publishing a pointer to readers that take no lock */
+#if defined _WIN32 && !defined __GNUC__
+# define apportable_load_ptr(p) InterlockedCompareExchangePointer((PVOID volatile *) (p), NULL, NULL)
+# define apportable_store_ptr(p, v) InterlockedExchangePointer((PVOID volatile *) (p), (v))
+#else
+# define apportable_load_ptr(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define apportable_store_ptr(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+/* the same for apportable_t.initialized: 0, -1 while being initialized, 1 */
+#if defined _WIN32 && !defined __GNUC__
+# define apportable_load_int(p) InterlockedCompareExchange((volatile LONG *) (p), 0, 0)
+# define apportable_store_int(p, v) InterlockedExchange((volatile LONG *) (p), (v))
+# define apportable_cas_int(p, o, n) (InterlockedCompareExchange((volatile LONG *) (p), (n), (o)) == (o))
+#else
+# define apportable_load_int(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define apportable_store_int(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+# define apportable_cas_int(p, o, n) __sync_bool_compare_and_swap((p), (o), (n))
+#endif
+#define apportable_lock(l) do { \
+        while (!apportable_trylock(l)) \
+            apportable_yield(); \
+    } while (0)
+
+/* built-in UTF-8 <-> UTF-32 transcoder, unless iconv is asked for */
+#if !defined _WIN32 && !defined APPORTABLE_ICONV && WCHAR_MAX > 0xFFFF
+# define APPORTABLE_NATIVE_UTF
+#endif
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+# define APPORTABLE_X86_SIMD
+# include <immintrin.h>
+#endif
+
+/* room for any path the system would accept */
+#if defined PATH_MAX
+# define APPORTABLE_PATHBUF PATH_MAX
+#elif defined MAX_PATH
+# define APPORTABLE_PATHBUF MAX_PATH
+#else
+# define APPORTABLE_PATHBUF 4096
+#endif
+
+/* directory listings for whereis, see APPORTABLE_WHEREIS_INDEX */
+#if !defined _WIN32
+# define APPORTABLE_PATHINDEX
+# if !defined APPORTABLE_PATHINDEX_TTL
+#  define APPORTABLE_PATHINDEX_TTL 1000   /* ms a listing is used without looking at the mtime */
+# endif
+#endif
+
+#define APPORTABLE_ICONV_WUTF8 0      /* wchar_t -> UTF-8 */
+#define APPORTABLE_ICONV_UWCHAR_T 1   /* UTF-8 -> wchar_t */
+
+static void _apportable_simd_dispatch (void);
+#if defined APPORTABLE_PROGCACHE
+static void _apportable_progcache_free (apportable self);
+static void _apportable_segindex_free (apportable self);
+#endif
+#if defined APPORTABLE_PATHINDEX
+static void _apportable_pathindex_free (apportable self);
+static void _apportable_dirfds_free (apportable self);
+#endif
+#if defined APPORTABLE_URING
+static void _apportable_uring_free (apportable self);
+#endif
+static void _apportable_interned_free (apportable self);
+static void _apportable_scratch_init (apportable self);
+static void _apportable_scratch_free (apportable self);
+static const struct apportable_exe * _apportable_exe_get (void);
+static void _apportable_dirs_free (apportable self);
+static void _apportable_env_free (apportable self);
+#if defined APPORTABLE_STATS
+static void _apportable_stats_free (apportable self);
+#endif
 
 static apportable_t apportable_global_state = {0, 0};
 
@@ -133,6 +262,40 @@ void apportable_init (
 
     a->_calloc = calloc;
     a->_free = free;
+    a->_arena = NULL;
+    a->_progcache = NULL;
+    a->_progcache_lock = 0;
+    a->_segindex = NULL;
+    a->_segindex_lock = 0;
+    a->_whereis_flags = 0;
+    a->_pathindex = NULL;
+    a->_pathindex_lock = 0;
+    a->_dirfds = NULL;
+    a->_dirfds_lock = 0;
+    a->_uring = NULL;
+    a->_uring_lock = 0;
+    a->_interned = NULL;
+    a->_interned_lock = 0;
+    a->_dirs = NULL;
+    a->_dirs_lock = 0;
+    a->_env = NULL;
+    a->_env_lock = 0;
+    a->_stats = NULL;
+    a->_stats_lock = 0;
+    _apportable_scratch_init(a);
+    _apportable_exe_get();   /* the snapshot, if no constructor took it */
+
+    _apportable_simd_dispatch();
+#if !defined _WIN32 && !defined APPORTABLE_NATIVE_UTF
+    /* conversions borrow these instead of opening a descriptor each time */
+    a->_iconv[APPORTABLE_ICONV_WUTF8] = iconv_open("UTF-8", a->_iconv_wchar_t);
+    a->_iconv[APPORTABLE_ICONV_UWCHAR_T] = iconv_open(a->_iconv_wchar_t, "UTF-8");
+    for (int i = 0; i < 2; i++) {
+        if (a->_iconv[i] == (void *) -1)
+            a->_iconv[i] = NULL;
+        a->_iconv_lock[i] = 0;
+    }
+#endif
 
     a->_strndup = &apportable_strndup;
     a->_wcsndup = &apportable_wcsndup;
@@ -148,11 +311,61 @@ void apportable_init (
     a->progfile = &apportable_progfile;
     a->pathexp = &apportable_pathexp;
     a->whereis = &apportable_whereis;
+
+    a->wutf8_into = &apportable_wutf8_into;
+    a->uwchar_t_into = &apportable_uwchar_t_into;
+    a->ugetenv_into = &apportable_ugetenv_into;
+    a->wugetenv_into = &apportable_wugetenv_into;
+    a->progfile_into = &apportable_progfile_into;
+    a->pathexp_into = &apportable_pathexp_into;
+    a->progfile_for_address = &apportable_progfile_for_address;
+    a->progfile_for_address_into = &apportable_progfile_for_address_into;
+    a->whereis_into = &apportable_whereis_into;
+    a->whereis_many = &apportable_whereis_many;
+    a->template_expand = &apportable_template_expand;
+    a->template_expand_into = &apportable_template_expand_into;
     a->enabled = enabled;
-    a->initialized = 1;
+    apportable_store_int(&a->initialized, 1);   /* publishes all of the above */
+
 
 
+    return;
+}
 
+
+void apportable_fini (
+        apportable a
+)
+{
+    if (apportable_load_int(&a->initialized) != 1)
+        return;
+#if defined APPORTABLE_STATS
+    _apportable_stats_free(a);
+#endif
+    apportable_arena_end(a);
+#if defined APPORTABLE_PROGCACHE
+    _apportable_progcache_free(a);
+    _apportable_segindex_free(a);
+#endif
+#if defined APPORTABLE_PATHINDEX
+    _apportable_pathindex_free(a);
+    _apportable_dirfds_free(a);
+#endif
+#if defined APPORTABLE_URING
+    _apportable_uring_free(a);
+#endif
+    _apportable_interned_free(a);
+    _apportable_dirs_free(a);
+    _apportable_env_free(a);
+    _apportable_scratch_free(a);
+#if !defined _WIN32
+    for (int i = 0; i < 2; i++) {
+        if (a->_iconv[i])
+            iconv_close((iconv_t) a->_iconv[i]);
+        a->_iconv[i] = NULL;
+    }
+#endif
+    apportable_store_int(&a->initialized, 0);
     return;
 }
 
@@ -168,586 +381,4326 @@ apportable apportable_getstate (apportable a)
         self = &apportable_global_state;
         default_enabled = 1;
     }
-    if (self->initialized)
+    if (apportable_load_int(&self->initialized) == 1)
         return self;
-    apportable_init(self, default_enabled);
+    /* first use: one thread initializes, any other waits for it */
+    if (apportable_cas_int(&self->initialized, 0, -1))
+        apportable_init(self, default_enabled);
+    else
+        while (apportable_load_int(&self->initialized) != 1)
+            apportable_yield();
     return self;
 }
 
 
 
-/* UTF-8 -> wchar_t -> UTF-8 */
-char * apportable_strndup(apportable a, const char * str, size_t syms)
+#if defined APPORTABLE_NATIVE_UTF
+
+/* Built-in UTF-8 <-> UTF-32 transcoder.
+ *
+ * Both directions accept exactly what glibc's and libiconv's converters
+ * accept (no overlong forms, no surrogates, nothing above U+10FFFF) and
+ * stop at the first offending sequence, where iconv would fail with
+ * EILSEQ, so results are identical to the iconv code path.  Called with
+ * dst == NULL they only measure, so the result can be allocated exactly.
+ * Runs of ASCII are handed to a vectorized helper picked at runtime. */
+
+/* return the number of leading elements (in whole blocks) that are ASCII,
+ * having copied them to dst if not NULL; unset without SIMD support */
+typedef size_t (*_apportable_ascii_fn) (void *, const void *, size_t);
+
+static _apportable_ascii_fn _apportable_ascii_widen = NULL;
+static _apportable_ascii_fn _apportable_ascii_narrow = NULL;
+
+#if defined APPORTABLE_X86_SIMD
+
+/* the SSE2 loops are inlined into the AVX2 ones for the tail, so they get
+ * VEX-encoded there instead of paying for an SSE/AVX state transition */
+__attribute__((target("sse2"), always_inline))
+static inline size_t _apportable_ascii_widen_sse2 (void * dst, const void * src, size_t n)
 {
-    // WORKS
+    const unsigned char * s = src;
+    wchar_t * d = dst;
+    __m128i z, v, lo, hi;
+    size_t i;
 
-    apportable self;
-    wchar_t * wstr, * buffer;
-    char * ret;
-    size_t buflen;
+    z = _mm_setzero_si128();
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (s + i));
+        if (_mm_movemask_epi8(v))
+            break;
+        if (!d)
+            continue;
+        lo = _mm_unpacklo_epi8(v, z);
+        hi = _mm_unpackhi_epi8(v, z);
+        _mm_storeu_si128((__m128i *) (d + i), _mm_unpacklo_epi16(lo, z));
+        _mm_storeu_si128((__m128i *) (d + i + 4), _mm_unpackhi_epi16(lo, z));
+        _mm_storeu_si128((__m128i *) (d + i + 8), _mm_unpacklo_epi16(hi, z));
+        _mm_storeu_si128((__m128i *) (d + i + 12), _mm_unpackhi_epi16(hi, z));
+    }
+    return i;
+}
 
-    self = APPORTABLE_STATE(a);
-    if (str == NULL)
-        return NULL;
+__attribute__((target("sse2"), always_inline))
+static inline size_t _apportable_ascii_narrow_sse2 (void * dst, const void * src, size_t n)
+{
+    const wchar_t * s = src;
+    unsigned char * d = dst;
+    __m128i hibits, a, b, c, e;
+    size_t i;
+
+    hibits = _mm_set1_epi32(~0x7F);
+    for (i = 0; i + 16 <= n; i += 16) {
+        a = _mm_loadu_si128((const __m128i *) (s + i));
+        b = _mm_loadu_si128((const __m128i *) (s + i + 4));
+        c = _mm_loadu_si128((const __m128i *) (s + i + 8));
+        e = _mm_loadu_si128((const __m128i *) (s + i + 12));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, e)), hibits), _mm_setzero_si128())) != 0xFFFF)
+            break;
+        if (d)
+            _mm_storeu_si128((__m128i *) (d + i), _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, e)));
+    }
+    return i;
+}
 
-    wstr = self->uwchar_t(self, str);
-    buflen = wcslen(wstr);
-    buffer = self->_wcsndup(self, wstr, syms);
+__attribute__((target("avx2")))
+static size_t _apportable_ascii_widen_avx2 (void * dst, const void * src, size_t n)
+{
+    const unsigned char * s = src;
+    wchar_t * d = dst;
+    __m256i v;
+    size_t i;
 
-    ret = self->wutf8(self, buffer);
+    for (i = 0; i + 32 <= n; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (s + i));
+        if (_mm256_movemask_epi8(v))
+            break;
+        if (!d)
+            continue;
+        _mm256_storeu_si256((__m256i *) (d + i), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (s + i))));
+        _mm256_storeu_si256((__m256i *) (d + i + 8), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (s + i + 8))));
+        _mm256_storeu_si256((__m256i *) (d + i + 16), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (s + i + 16))));
+        _mm256_storeu_si256((__m256i *) (d + i + 24), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (s + i + 24))));
+    }
+    return i + _apportable_ascii_widen_sse2(d ? d + i : NULL, s + i, n - i);
+}
 
-    // // return ret;
-    // char * x = malloc(1000);
-    // sprintf(x, "%zu %zu L<%ls> <%s>", syms, buflen, buffer, ret);
-    // return x;
+__attribute__((target("avx2")))
+static size_t _apportable_ascii_narrow_avx2 (void * dst, const void * src, size_t n)
+{
+    const wchar_t * s = src;
+    unsigned char * d = dst;
+    __m256i hibits, order, a, b, c, e;
+    size_t i;
 
-    free(buffer);
-    return ret;
+    hibits = _mm256_set1_epi32(~0x7F);
+    /* the packs below interleave 128-bit lanes, this undoes it */
+    order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for (i = 0; i + 32 <= n; i += 32) {
+        a = _mm256_loadu_si256((const __m256i *) (s + i));
+        b = _mm256_loadu_si256((const __m256i *) (s + i + 8));
+        c = _mm256_loadu_si256((const __m256i *) (s + i + 16));
+        e = _mm256_loadu_si256((const __m256i *) (s + i + 24));
+        if (!_mm256_testz_si256(_mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, e)), hibits))
+            break;
+        if (d)
+            _mm256_storeu_si256((__m256i *) (d + i), _mm256_permutevar8x32_epi32(
+                    _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, e)), order));
+    }
+    return i + _apportable_ascii_narrow_sse2(d ? d + i : NULL, s + i, n - i);
 }
 
+#endif /*APPORTABLE_X86_SIMD*/
 
-wchar_t * apportable_wcsndup(apportable a, const wchar_t * str, size_t syms)
+
+/* UTF-8 -> wchar_t, returns the number of wchar_t (without terminator) */
+static size_t _apportable_utf8_decode (wchar_t * dst, const char * src, size_t n)
 {
-    apportable self;
-    wchar_t * buffer;
-    size_t buflen;
-    size_t copysyms;
+    const unsigned char * s = (const unsigned char *) src;
+    size_t i, o, k, retry;
+    unsigned char c, lo, hi;
+    wchar_t cp;
 
-    self = APPORTABLE_STATE(a);
-    if (str == NULL)
-        return NULL;
-    buflen = wcslen(str);
-    if (syms == 0)
-        syms = buflen;
-    if (!(copysyms = syms))
-        copysyms = (syms > buflen ? buflen : syms);
-    if ((buffer = self->_calloc(sizeof(wchar_t), buflen + 1)))
-        wcsncpy(buffer, str, copysyms);
-    // sprintf(buffer, L"%d %d", strlen(buffer), strlen(str));
-    return buffer;
+    i = o = retry = 0;
+    while (i < n) {
+        c = s[i];
+        if (c < 0x80) {
+            if (i >= retry && _apportable_ascii_widen) {
+                k = _apportable_ascii_widen(dst ? dst + o : NULL, s + i, n - i);
+                i += k, o += k;
+                if (k)
+                    continue;
+                retry = i + 16;   /* mixed text, don't probe every byte */
+            }
+            if (dst)
+                dst[o] = c;
+            i++, o++;
+            continue;
+        }
+        lo = 0x80, hi = 0xBF;
+        if (c >= 0xC2 && c <= 0xDF) {
+            k = 1, cp = c & 0x1F;
+        } else if (c >= 0xE0 && c <= 0xEF) {
+            k = 2, cp = c & 0x0F;
+            if (c == 0xE0)
+                lo = 0xA0;   /* overlong */
+            else if (c == 0xED)
+                hi = 0x9F;   /* surrogates */
+        } else if (c >= 0xF0 && c <= 0xF4) {
+            k = 3, cp = c & 0x07;
+            if (c == 0xF0)
+                lo = 0x90;   /* overlong */
+            else if (c == 0xF4)
+                hi = 0x8F;   /* above U+10FFFF */
+        } else
+            break;
+        if (n - i <= k || s[i + 1] < lo || s[i + 1] > hi)
+            break;
+        cp = (cp << 6) | (s[i + 1] & 0x3F);
+        if (k > 1) {
+            if ((s[i + 2] & 0xC0) != 0x80)
+                break;
+            cp = (cp << 6) | (s[i + 2] & 0x3F);
+        }
+        if (k > 2) {
+            if ((s[i + 3] & 0xC0) != 0x80)
+                break;
+            cp = (cp << 6) | (s[i + 3] & 0x3F);
+        }
+        if (dst)
+            dst[o] = cp;
+        i += k + 1, o++;
+    }
+    return o;
 }
 
 
-#ifdef _WIN32
+/* wchar_t -> UTF-8, returns the number of bytes (without terminator) */
+static size_t _apportable_utf8_encode (char * dst, const wchar_t * src, size_t n)
+{
+    unsigned char * d = (unsigned char *) dst;
+    size_t i, o, k, retry;
+    wchar_t cp;
 
-char * apportable_wutf8 (apportable a, const wchar_t * s)
+    i = o = retry = 0;
+    while (i < n) {
+        cp = src[i];
+        if (cp >= 0 && cp < 0x80) {
+            if (i >= retry && _apportable_ascii_narrow) {
+                k = _apportable_ascii_narrow(d ? d + o : NULL, src + i, n - i);
+                i += k, o += k;
+                if (k)
+                    continue;
+                retry = i + 16;
+            }
+            if (d)
+                d[o] = (unsigned char) cp;
+            i++, o++;
+            continue;
+        }
+        if (cp < 0 || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+            break;
+        if (cp < 0x800) {
+            if (d) {
+                d[o] = 0xC0 | (cp >> 6);
+                d[o + 1] = 0x80 | (cp & 0x3F);
+            }
+            o += 2;
+        } else if (cp < 0x10000) {
+            if (d) {
+                d[o] = 0xE0 | (cp >> 12);
+                d[o + 1] = 0x80 | ((cp >> 6) & 0x3F);
+                d[o + 2] = 0x80 | (cp & 0x3F);
+            }
+            o += 3;
+        } else {
+            if (d) {
+                d[o] = 0xF0 | (cp >> 18);
+                d[o + 1] = 0x80 | ((cp >> 12) & 0x3F);
+                d[o + 2] = 0x80 | ((cp >> 6) & 0x3F);
+                d[o + 3] = 0x80 | (cp & 0x3F);
+            }
+            o += 4;
+        }
+        i++;
+    }
+    return o;
+}
+
+#endif /*APPORTABLE_NATIVE_UTF*/
+
+
+/* Arena allocation
+ *
+ * While an arena is attached, results and temporaries are carved out of
+ * a few large chunks; apportable_free() of such memory does nothing
+ * (except giving back the latest allocation), and apportable_arena_reset()
+ * releases all of it at once.  An arena belongs to the thread running the
+ * batch, and must not be shared by concurrent callers of the state. */
+
+#define APPORTABLE_ARENA_ALIGN 16
+#define APPORTABLE_ARENA_MIN 4096
+
+struct apportable_arena
 {
-    apportable self;
-    char * b;
-    size_t s_l, b_l;
+    struct apportable_arena * next;   /* older, smaller chunks */
+    size_t size;
+    size_t used;
+    size_t last;                      /* offset of the latest allocation */
+};
 
-    self = APPORTABLE_STATE(a);
-    if (s == NULL)
+/* chunk header, rounded up so data stays aligned */
+#define APPORTABLE_ARENA_HDR \
+    ((sizeof(struct apportable_arena) + APPORTABLE_ARENA_ALIGN - 1) & ~(size_t) (APPORTABLE_ARENA_ALIGN - 1))
+
+
+static struct apportable_arena * _apportable_arena_chunk (apportable self, size_t size, struct apportable_arena * next)
+{
+    struct apportable_arena * chunk;
+
+    if (size < APPORTABLE_ARENA_MIN)
+        size = APPORTABLE_ARENA_MIN;
+    if (!(chunk = self->_calloc(1, APPORTABLE_ARENA_HDR + size)))
         return NULL;
-    s_l = wcslen(s);
-    b_l = WideCharToMultiByte(CP_UTF8, 0, s, s_l, NULL, 0, NULL, NULL);
-    b = self->_calloc(sizeof(wchar_t), b_l + 1);
-    WideCharToMultiByte(CP_UTF8, 0, s, s_l, b, b_l, NULL, NULL);
-    return b;
+    chunk->next = next;
+    chunk->size = size;
+    chunk->used = chunk->last = 0;
+    return chunk;
 }
 
-char * apportable_wutf8_free(apportable a, wchar_t * s)
+
+int apportable_arena_begin (apportable a, size_t size)
 {
     apportable self;
-    char * ret;
 
     self = APPORTABLE_STATE(a);
-    ret = self->wutf8(self, s);
-    self->_free(s);
-    return ret;
+    if (self->_arena)
+        return 0;
+    if (!(self->_arena = _apportable_arena_chunk(self, size, NULL)))
+        return -1;
+    return 0;
 }
 
 
-wchar_t * apportable_uwchar_t (apportable a, const char * s)
+void apportable_arena_reset (apportable a)
 {
     apportable self;
-    char * b;
-    size_t s_l, b_l;
+    struct apportable_arena * chunk, * next;
 
     self = APPORTABLE_STATE(a);
-    if (s == NULL)
-        return NULL;
-    s_l = strlen(s) + 1;
-    b_l = MultiByteToWideChar(CP_UTF8, 0, s, s_l, NULL, 0);
-    b = self->_calloc(sizeof(wchar_t), b_l + 0);
-    MultiByteToWideChar(CP_UTF8, 0, s, s_l, b, b_l);
-    return b;
+    if (!(chunk = self->_arena))
+        return;
+    /* keep the newest chunk, which is the largest */
+    for (next = chunk->next; next; next = chunk->next) {
+        chunk->next = next->next;
+        self->_free(next);
+    }
+    chunk->used = chunk->last = 0;
 }
 
-wchar_t * apportable_uwchar_t_free (apportable a, const char * s)
+
+void apportable_arena_end (apportable a)
 {
     apportable self;
-    char * ret;
+    struct apportable_arena * chunk;
 
     self = APPORTABLE_STATE(a);
-    ret = self->uwchar_t(self, s);
-    self->_free(s);
-    return ret;
+    while ((chunk = self->_arena)) {
+        self->_arena = chunk->next;
+        self->_free(chunk);
+    }
 }
 
 
-
-char * apportable_ugetenv (apportable a, const char * var)
+void * apportable_calloc (apportable a, size_t count, size_t size)
 {
     apportable self;
-    wchar_t * v;
-    size_t var_l, v_l;
+    struct apportable_arena * chunk;
+    size_t bytes;
+    char * p;
 
     self = APPORTABLE_STATE(a);
-    var_l = strlen(var) + 1;
-    v_l = MultiByteToWideChar(CP_UTF8, 0, var, var_l, NULL, 0);
-    v = self->_calloc(sizeof(wchar_t), v_l + 0);
-    MultiByteToWideChar(CP_UTF8, 0, var, var_l, v, v_l);
-    return self->wutf8(self, _wgetenv(v));
+    if (!(chunk = self->_arena))
+        return self->_calloc(count, size);
+    if (size && count > (size_t) -1 / 2 / size)
+        return NULL;
+    bytes = (count * size + APPORTABLE_ARENA_ALIGN - 1) & ~(size_t) (APPORTABLE_ARENA_ALIGN - 1);
+    if (bytes > chunk->size - chunk->used) {
+        if (!(chunk = _apportable_arena_chunk(self, bytes > 2 * chunk->size ? bytes : 2 * chunk->size, chunk)))
+            return NULL;
+        self->_arena = chunk;
+    }
+    p = (char *) chunk + APPORTABLE_ARENA_HDR + chunk->used;
+    chunk->last = chunk->used;
+    chunk->used += bytes;
+    memset(p, 0, bytes);   /* chunks are reused after a reset */
+    return p;
 }
 
-char * apportable_wugetenv (apportable a, const wchar_t * var)
+
+void apportable_free (apportable a, void * p)
 {
     apportable self;
-    wchar_t * v;
-    size_t var_l, v_l;
+    struct apportable_arena * chunk;
+    char * data;
 
     self = APPORTABLE_STATE(a);
-    var_l = wcslen(var) + 1;
-    v_l = MultiByteToWideChar(CP_UTF8, 0, var, var_l, NULL, 0);
-    v = self->_calloc(sizeof(wchar_t), v_l + 0);
-    MultiByteToWideChar(CP_UTF8, 0, var, var_l, v, v_l);
-    return self->wutf8(self, _wgetenv(v));
+    if (!p)
+        return;
+    for (chunk = self->_arena; chunk; chunk = chunk->next) {
+        data = (char *) chunk + APPORTABLE_ARENA_HDR;
+        if ((char *) p < data || (char *) p >= data + chunk->size)
+            continue;
+        /* a temporary freed right away can be handed out again */
+        if (chunk == self->_arena && (char *) p == data + chunk->last)
+            chunk->used = chunk->last;
+        return;
+    }
+    self->_free(p);
 }
 
 
 
 
+/* Scratch buffers
+ *
+ * Intermediate stages of a conversion (a variable name in another
+ * encoding, the output of iconv before it is copied to its final size)
+ * go to a buffer each thread keeps per state, grown as needed, instead
+ * of a malloc and free per call.  The buffers live until their thread
+ * exits or apportable_fini.  Only one stage at a time uses it; a nested
+ * or oversized request, or a platform without thread-local storage,
+ * goes to the heap as before. */
 
+#define APPORTABLE_SCRATCH_MIN 256
+#define APPORTABLE_SCRATCH_MAX 65536   /* larger requests are not kept */
 
-#else /*!_WIN32*/
+#if defined _WIN32
+# define APPORTABLE_TLS_CALLBACK NTAPI
+# define apportable_tls_get(k) FlsGetValue((DWORD) (k))
+# define apportable_tls_set(k, v) (FlsSetValue((DWORD) (k), (v)) != 0)
+#else
+# define APPORTABLE_TLS_CALLBACK
+# define apportable_tls_get(k) pthread_getspecific((pthread_key_t) (k))
+# define apportable_tls_set(k, v) (pthread_setspecific((pthread_key_t) (k), (v)) == 0)
+#endif
 
-char * apportable_wutf8 (apportable a, const wchar_t * s)
+struct apportable_scratch
 {
     apportable self;
-    char * ret;
-    size_t s_l, ret_l;
-    /* iconv expects in-out params, so allocate copies */
-    wchar_t * iconv_s;
-    char * iconv_ret;
-    size_t iconv_s_l, iconv_ret_l;
-    iconv_t iconv_obj;
-
-    self = APPORTABLE_STATE(a);
-    s_l = sizeof(wchar_t) * ( wcslen(s) + 1 );
-    iconv_obj = iconv_open("UTF-8", self->_iconv_wchar_t);
-    if (iconv_obj == (iconv_t) -1) {
-        return NULL;
-    }
-    ret_l = sizeof(char) * ( s_l + 1 );
-    ret = self->_calloc(1, ret_l);
+    struct apportable_scratch * next, ** prev;   /* in self->_scratch */
+    size_t cap;
+    int busy;
+};
 
-    iconv_s = (wchar_t *) s, iconv_ret = ret;
-    iconv_s_l = s_l, iconv_ret_l = ret_l;
-    iconv(iconv_obj, (char **)&iconv_s, &iconv_s_l, &iconv_ret, &iconv_ret_l);
-    iconv_close(iconv_obj);
+/* buffer header, rounded up so data stays aligned */
+#define APPORTABLE_SCRATCH_HDR \
+    ((sizeof(struct apportable_scratch) + APPORTABLE_ARENA_ALIGN - 1) & ~(size_t) (APPORTABLE_ARENA_ALIGN - 1))
 
-    // char * b = malloc(1000);
-    // sprintf(b, "%zu '%ls' '%s'", ret_l, s, ret);
-    // printf("%s\n", b);
-    // return b;
 
-    return ret;
+static void _apportable_scratch_unlink (struct apportable_scratch * sc)
+{
+    if ((*sc->prev = sc->next))
+        sc->next->prev = sc->prev;
 }
 
-char * apportable_wutf8_free (apportable a, wchar_t * s)
+/* a thread holding a buffer exits */
+static void APPORTABLE_TLS_CALLBACK _apportable_scratch_exit (void * p)
 {
+    struct apportable_scratch * sc;
     apportable self;
-    char * ret;
 
-    self = APPORTABLE_STATE(a);
-    ret = self->wutf8(self, s);
-    self->_free(s);
-    return ret;
+    if (!(sc = p))
+        return;
+    /* a call of its own, for the allocation statistics */
+    self = APPORTABLE_STATE(sc->self);
+    apportable_lock(&self->_scratch_lock);
+    _apportable_scratch_unlink(sc);
+    apportable_unlock(&self->_scratch_lock);
+    self->_free(sc);
 }
 
+static void _apportable_scratch_init (apportable self)
+{
+#if defined _WIN32
+    DWORD key;
+
+    key = FlsAlloc(_apportable_scratch_exit);
+    self->_scratch_keyed = key != FLS_OUT_OF_INDEXES;
+#else
+    pthread_key_t key;
 
+    self->_scratch_keyed = pthread_key_create(&key, _apportable_scratch_exit) == 0;
+#endif
+    self->_scratch_key = self->_scratch_keyed ? (unsigned long) key : 0;
+    self->_scratch = NULL;
+    self->_scratch_lock = 0;
+}
 
-wchar_t * apportable_uwchar_t (apportable a, const char * s)
+static void _apportable_scratch_free (apportable self)
 {
-    apportable self;
-    wchar_t * ret;
-    wchar_t * buffer;
-    size_t s_l, buffer_l;
-    /* iconv expects in-out params, so allocate copies */
-    char * iconv_s;
-    wchar_t * iconv_buffer;
-    size_t iconv_s_l, iconv_buffer_l;
-    iconv_t iconv_obj;
+    struct apportable_scratch * sc;
 
-    self = APPORTABLE_STATE(a);
-    s_l = sizeof(char) * ( strlen(s) + 1 );
-    iconv_obj = iconv_open(self->_iconv_wchar_t, "UTF-8");
-    if (iconv_obj == (iconv_t) -1) {
-        return NULL;
+    if (!self->_scratch_keyed)
+        return;
+    /* no destructors run for the threads still alive, free theirs here;
+     * FlsFree calls ours, which unlink themselves */
+#if defined _WIN32
+    FlsFree((DWORD) self->_scratch_key);
+#else
+    pthread_key_delete((pthread_key_t) self->_scratch_key);
+#endif
+    self->_scratch_keyed = 0;
+    apportable_lock(&self->_scratch_lock);
+    while ((sc = self->_scratch)) {
+        _apportable_scratch_unlink(sc);
+        self->_free(sc);
     }
-    buffer_l = sizeof(wchar_t) * ( s_l + 1 );
-    buffer = self->_calloc(1, buffer_l);
-
-    iconv_s = (char *) s, iconv_buffer = buffer;
-    iconv_s_l = s_l, iconv_buffer_l = buffer_l;
-    iconv(iconv_obj, (char **)&iconv_s, &iconv_s_l, (char **) &iconv_buffer, &iconv_buffer_l);
-    
-    // char * b2 = malloc(1000);
-    // sprintf(b2, "%d->%d %d->%d <%ls> <%s>", s_l, iconv_s_l, buffer_l, iconv_buffer_l, s, buffer);
-    // return b2;
-    
-    iconv_close(iconv_obj);
-    ret = self->_wcsndup(self, buffer, 0);
-    self->_free(buffer);
-    return ret;
+    apportable_unlock(&self->_scratch_lock);
 }
 
-wchar_t * apportable_uwchar_t_free (apportable a, char * s)
+/* the calling thread's buffer, of size bytes at least and marked busy;
+ * NULL if it cannot be had */
+static void * _apportable_scratch_get (apportable self, size_t size)
 {
-    apportable self;
-    wchar_t * ret;
+    struct apportable_scratch * sc, * grown;
+    size_t cap;
 
-    self = APPORTABLE_STATE(a);
-    ret = self->uwchar_t(self, s);
-    self->_free(s);
-    return ret;
+    if (!self->_scratch_keyed || size > APPORTABLE_SCRATCH_MAX)
+        return NULL;
+    sc = apportable_tls_get(self->_scratch_key);
+    if (sc && sc->busy)
+        return NULL;
+    if (!sc || sc->cap < size) {
+        for (cap = sc ? 2 * sc->cap : APPORTABLE_SCRATCH_MIN; cap < size; cap *= 2)
+            ;
+        if (cap > APPORTABLE_SCRATCH_MAX)
+            cap = APPORTABLE_SCRATCH_MAX;
+        if (!(grown = self->_calloc(1, APPORTABLE_SCRATCH_HDR + cap)))
+            return NULL;
+        grown->self = self;
+        grown->cap = cap;
+        if (!apportable_tls_set(self->_scratch_key, grown)) {
+            self->_free(grown);
+            return NULL;
+        }
+        apportable_lock(&self->_scratch_lock);
+        if (sc)
+            _apportable_scratch_unlink(sc);
+        if ((grown->next = self->_scratch))
+            grown->next->prev = &grown->next;
+        grown->prev = &self->_scratch;
+        self->_scratch = grown;
+        apportable_unlock(&self->_scratch_lock);
+        if (sc)
+            self->_free(sc);
+        sc = grown;
+    }
+    sc->busy = 1;
+    return (char *) sc + APPORTABLE_SCRATCH_HDR;
 }
 
-
-
-
-char * apportable_ugetenv (apportable a, char * var)
+/* size bytes, uninitialized, for the calling thread until
+ * _apportable_scratch_done; NULL if out of memory */
+static void * _apportable_scratch (apportable self, size_t size)
 {
-    apportable self;
-    char * ret;
+    void * p;
 
-    self = APPORTABLE_STATE(a);
-    if (!(ret = self->_strndup(self, getenv(var), 0)))
-        ret = self->_strndup(self, "", 0);
-    return ret;
+    if (!(p = _apportable_scratch_get(self, size)))
+        p = mem_calloc(self, char, size);
+    return p;
 }
 
-char * apportable_wugetenv (apportable a, wchar_t * wvar)
+static void _apportable_scratch_done (apportable self, void * p)
 {
-    apportable self;
-    char * var, * ret;
+    struct apportable_scratch * sc;
 
-    self = APPORTABLE_STATE(a);
-    var = self->wutf8(self, wvar);
-    if (!(ret = self->ugetenv(self, var)))
-        ret = self->_strndup(self, "", 0);
-    self->_free(var);
-    return ret;
+    if (!p)
+        return;
+    if (self->_scratch_keyed && (sc = apportable_tls_get(self->_scratch_key))
+            && p == (char *) sc + APPORTABLE_SCRATCH_HDR) {
+        sc->busy = 0;
+        return;
+    }
+    mem_free(self, p);
 }
 
-#endif
 
+/* Allocation statistics
+ *
+ * apportable_stats_enable puts counting hooks in place of _calloc and
+ * _free.  Live blocks are kept in a table by address, with their size
+ * and the function that allocated them, so the blocks themselves are
+ * untouched: a result released with free() instead of apportable_free
+ * stays outstanding (until its address is handed out again), and
+ * anything allocated before the hooks is freed as usual. */
 
+#if defined APPORTABLE_STATS
 
-#ifdef _WIN32
+#define APPORTABLE_STATS_FNS 96   /* functions told apart, the last for any others */
 
-/* for UTF-16 "wide" character */
-wchar_t * apportable_wprogfile (apportable a, const wchar_t * library_name) {
-    apportable self;
-	wchar_t * ret;
-	HMODULE handle;
-    wchar_t * wfile;
-    wchar_t * file;
+struct apportable_stats_block
+{
+    const void * p;   /* NULL if free */
+    size_t size;
+    unsigned fn;
+};
 
-    self = APPORTABLE_STATE(a);
-    if (!self->enabled)
-        return self->_wcsndup(self, library_name, 0);
+struct apportable_stats
+{
+    void * (*calloc) (size_t, size_t);   /* the hooks wrapped */
+    void (*free) (void *);
+    struct apportable_stat total;
+    unsigned count;
+    struct apportable_stat fn[APPORTABLE_STATS_FNS];
+    size_t mask, used;
+    struct apportable_stats_block * blocks;
+};
 
-    ret = NULL;
-    handle = NULL;
-    if (!GetModuleHandleExW(0, library_name, &handle)) {
+static __thread struct apportable_call _apportable_call_now;
+
+/* Outside any call the hooks cannot tell the state: they use the
+ * allocator the last enabled state wrapped.  The library itself always
+ * allocates inside a call, a thread's exit included. */
+static void * (* volatile _apportable_stats_outside_calloc) (size_t, size_t);
+static void (* volatile _apportable_stats_outside_free) (void *);
+
+
+static size_t _apportable_stats_slot (const struct apportable_stats * stats, const void * p)
+{
+    return (size_t) (((uintptr_t) p >> 4) * (uintptr_t) 0x9e3779b97f4a7c15ull) & stats->mask;
+}
+
+/* the entry of fn, added if new */
+static unsigned _apportable_stats_fn (struct apportable_stats * stats, const char * fn)
+{
+    unsigned i;
+
+    if (!fn)
+        fn = "(none)";
+    for (i = 0; i < stats->count; i++)
+        if (stats->fn[i].name == fn)
+            return i;
+    if (stats->count == APPORTABLE_STATS_FNS - 1)
+        fn = "(other)";
+    if (stats->count == APPORTABLE_STATS_FNS)
+        return APPORTABLE_STATS_FNS - 1;
+    stats->fn[stats->count].name = fn;
+    return stats->count++;
+}
+
+static void _apportable_stats_count (struct apportable_stat * st, size_t size, int freed)
+{
+    if (freed) {
+        st->frees++;
+        st->outstanding--;
+        st->live -= size;
+        return;
+    }
+    st->allocs++;
+    st->outstanding++;
+    st->bytes += size;
+    if ((st->live += size) > st->peak)
+        st->peak = st->live;
+}
+
+static void _apportable_stats_remove (struct apportable_stats * stats, size_t i)
+{
+    struct apportable_stats_block * b;
+    size_t j, k;
+
+    b = stats->blocks;
+    _apportable_stats_count(&stats->total, b[i].size, 1);
+    _apportable_stats_count(&stats->fn[b[i].fn], b[i].size, 1);
+    /* shift back whatever probed past i */
+    for (j = i; ; ) {
+        j = (j + 1) & stats->mask;
+        if (!b[j].p)
+            break;
+        k = _apportable_stats_slot(stats, b[j].p);
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        b[i] = b[j];
+        i = j;
+    }
+    b[i].p = NULL;
+    stats->used--;
+}
+
+static void _apportable_stats_add (struct apportable_stats * stats, const void * p, size_t size, unsigned fn)
+{
+    struct apportable_stats_block * old, * b;
+    size_t oldmask, i, j;
+
+    if ((stats->used + 1) * 2 > stats->mask + 1) {
+        old = stats->blocks;
+        oldmask = stats->mask;
+        if ((b = stats->calloc(2 * (oldmask + 1), sizeof(*b)))) {
+            stats->blocks = b;
+            stats->mask = 2 * oldmask + 1;
+            for (i = 0; i <= oldmask; i++) {
+                if (!old[i].p)
+                    continue;
+                for (j = _apportable_stats_slot(stats, old[i].p); b[j].p; j = (j + 1) & stats->mask)
+                    ;
+                b[j] = old[i];
+            }
+            stats->free(old);
+        }
+    }
+    b = stats->blocks;
+    for (i = _apportable_stats_slot(stats, p); b[i].p; i = (i + 1) & stats->mask)
+        if (b[i].p == p) {
+            /* released with free(), and now given out again */
+            _apportable_stats_remove(stats, i);
+            _apportable_stats_add(stats, p, size, fn);
+            return;
+        }
+    if (stats->used + 1 > stats->mask)
+        return;   /* full, and could not grow: not tracked */
+    b[i].p = p;
+    b[i].size = size;
+    b[i].fn = fn;
+    stats->used++;
+    _apportable_stats_count(&stats->total, size, 0);
+    _apportable_stats_count(&stats->fn[fn], size, 0);
+}
+
+static void * _apportable_counting_calloc (size_t count, size_t size)
+{
+    apportable self;
+    struct apportable_stats * stats;
+    void * p;
+
+    self = _apportable_call_now.self;
+    if (!self || !(stats = apportable_load_ptr(&self->_stats)))
+        return _apportable_stats_outside_calloc(count, size);
+    if (!(p = stats->calloc(count, size)))
+        return NULL;
+    apportable_lock(&self->_stats_lock);
+    _apportable_stats_add(stats, p, count * size, _apportable_stats_fn(stats, _apportable_call_now.fn));
+    apportable_unlock(&self->_stats_lock);
+    return p;
+}
+
+static void _apportable_counting_free (void * p)
+{
+    apportable self;
+    struct apportable_stats * stats;
+    struct apportable_stats_block * b;
+    size_t i;
+
+    self = _apportable_call_now.self;
+    if (!self || !(stats = apportable_load_ptr(&self->_stats))) {
+        _apportable_stats_outside_free(p);
+        return;
+    }
+    if (p) {
+        apportable_lock(&self->_stats_lock);
+        b = stats->blocks;
+        for (i = _apportable_stats_slot(stats, p); b[i].p; i = (i + 1) & stats->mask)
+            if (b[i].p == p) {
+                _apportable_stats_remove(stats, i);
+                break;
+            }
+        apportable_unlock(&self->_stats_lock);
+    }
+    stats->free(p);
+}
+
+static struct apportable_call _apportable_stats_enter (apportable self, const char * fn)
+{
+    struct apportable_call prev;
+    struct apportable_stats * stats;
+
+    prev = _apportable_call_now;
+    _apportable_call_now.self = self;
+    if (prev.fn)
+        return prev;   /* nested, the outer call keeps it */
+    _apportable_call_now.fn = fn;
+    if ((stats = apportable_load_ptr(&self->_stats))) {
+        apportable_lock(&self->_stats_lock);
+        stats->fn[_apportable_stats_fn(stats, fn)].calls++;
+        stats->total.calls++;
+        apportable_unlock(&self->_stats_lock);
+    }
+    return prev;
+}
+
+static void _apportable_stats_leave (struct apportable_call * prev)
+{
+    _apportable_call_now = *prev;
+}
+
+/* by apportable_fini, first: from then on the wrapped hooks are used */
+static void _apportable_stats_free (apportable self)
+{
+    struct apportable_stats * stats;
+
+    if (!(stats = self->_stats))
+        return;
+    self->_calloc = stats->calloc;
+    self->_free = stats->free;
+    self->_stats = NULL;
+    stats->free(stats->blocks);
+    stats->free(stats);
+}
+
+int apportable_stats_enable (apportable a)
+{
+    apportable self;
+    struct apportable_stats * stats;
+
+    self = APPORTABLE_STATE(a);
+    if (apportable_load_ptr(&self->_stats))
+        return 0;
+    if (!(stats = self->_calloc(1, sizeof(*stats))))
+        return -1;
+    stats->mask = 255;
+    if (!(stats->blocks = self->_calloc(stats->mask + 1, sizeof(*stats->blocks)))) {
+        self->_free(stats);
+        return -1;
+    }
+    stats->total.name = "";
+    apportable_lock(&self->_stats_lock);
+    if (self->_stats) {
+        /* another thread was first */
+        apportable_unlock(&self->_stats_lock);
+        self->_free(stats->blocks);
+        self->_free(stats);
+        return 0;
+    }
+    stats->calloc = self->_calloc;
+    stats->free = self->_free;
+    apportable_store_ptr(&_apportable_stats_outside_calloc, stats->calloc);
+    apportable_store_ptr(&_apportable_stats_outside_free, stats->free);
+    /* the table first, for hooks other threads may call right away */
+    apportable_store_ptr(&self->_stats, stats);
+    apportable_store_ptr(&self->_calloc, _apportable_counting_calloc);
+    apportable_store_ptr(&self->_free, _apportable_counting_free);
+    apportable_unlock(&self->_stats_lock);
+    return 0;
+}
+
+size_t apportable_stats (apportable a, struct apportable_stat * total, struct apportable_stat * fn, size_t n)
+{
+    apportable self;
+    struct apportable_stats * stats;
+    size_t count;
+
+    self = APPORTABLE_STATE(a);
+    if (!(stats = apportable_load_ptr(&self->_stats)))
+        return 0;
+    apportable_lock(&self->_stats_lock);
+    if (total)
+        *total = stats->total;
+    count = stats->count;
+    if (fn)
+        memcpy(fn, stats->fn, (n < count ? n : count) * sizeof(*fn));
+    apportable_unlock(&self->_stats_lock);
+    return count;
+}
+
+/* what was allocated and freed is forgotten, what is live stays */
+static void _apportable_stats_zero (struct apportable_stat * st)
+{
+    st->calls = st->allocs = st->frees = st->bytes = 0;
+    st->peak = st->live;
+}
+
+void apportable_stats_reset (apportable a)
+{
+    apportable self;
+    struct apportable_stats * stats;
+    unsigned i;
+
+    self = APPORTABLE_STATE(a);
+    if (!(stats = apportable_load_ptr(&self->_stats)))
+        return;
+    apportable_lock(&self->_stats_lock);
+    _apportable_stats_zero(&stats->total);
+    for (i = 0; i < stats->count; i++)
+        _apportable_stats_zero(&stats->fn[i]);
+    apportable_unlock(&self->_stats_lock);
+}
+
+#else /*APPORTABLE_STATS*/
+
+int apportable_stats_enable (apportable a)
+{
+    (void) a;
+    return -1;
+}
+
+size_t apportable_stats (apportable a, struct apportable_stat * total, struct apportable_stat * fn, size_t n)
+{
+    (void) a, (void) total, (void) fn, (void) n;
+    return 0;
+}
+
+void apportable_stats_reset (apportable a)
+{
+    (void) a;
+}
+
+#endif /*APPORTABLE_STATS*/
+
+
+/* Tracing
+ *
+ * Built with APPORTABLE_TRACE, the slow phases (system lookups, iconv,
+ * walks of the loaded objects, the access() loop of whereis) record
+ * begin and end events with a monotonic timestamp.  Each thread writes to
+ * a ring of its own, without locks: the thread only advances the head,
+ * apportable_trace_write only the tail, and events that find the ring
+ * full are dropped and counted.  Rings are kept until the process exits.
+ * Without APPORTABLE_TRACE the macros are empty. */
+
+#if defined APPORTABLE_TRACE
+
+#if !defined APPORTABLE_TRACE_EVENTS
+# define APPORTABLE_TRACE_EVENTS 8192   /* per thread, a power of 2 */
+#endif
+
+#if defined _MSC_VER
+# define APPORTABLE_THREAD_LOCAL __declspec(thread)
+#else
+# define APPORTABLE_THREAD_LOCAL __thread
+#endif
+
+# define APPORTABLE_TRACE_BEGIN(name) _apportable_trace((name), 'B')
+# define APPORTABLE_TRACE_END(name) _apportable_trace((name), 'E')
+
+struct apportable_trace_event
+{
+    const char * name;   /* a literal */
+    unsigned long long ns;
+    int ph;              /* 'B' or 'E', as Chrome has them */
+};
+
+struct apportable_trace_ring
+{
+    struct apportable_trace_ring * next;   /* every thread's */
+    long tid;
+    volatile int head;   /* both modulo 2 * APPORTABLE_TRACE_EVENTS */
+    volatile int tail;
+    volatile long dropped;
+    struct apportable_trace_event ev[APPORTABLE_TRACE_EVENTS];
+};
+
+#define APPORTABLE_TRACE_WRAP (2 * APPORTABLE_TRACE_EVENTS - 1)
+
+static struct apportable_trace_ring * _apportable_trace_rings;
+static volatile long _apportable_trace_lock;   /* the list, and writers of the tails */
+static long _apportable_trace_tids;
+static APPORTABLE_THREAD_LOCAL struct apportable_trace_ring * _apportable_trace_mine;
+
+static unsigned long long _apportable_trace_now (void)
+{
+#if defined _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    if (!freq.QuadPart)
+        QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (unsigned long long) (now.QuadPart / freq.QuadPart) * 1000000000ull
+        + (unsigned long long) (now.QuadPart % freq.QuadPart) * 1000000000ull / freq.QuadPart;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+static void _apportable_trace (const char * name, int ph)
+{
+    struct apportable_trace_ring * ring;
+    struct apportable_trace_event * ev;
+    int head;
+
+    if (!(ring = _apportable_trace_mine)) {
+        /* the thread's first event */
+        if (!(ring = calloc(1, sizeof(*ring))))
+            return;
+        apportable_lock(&_apportable_trace_lock);
+        ring->tid = ++_apportable_trace_tids;
+        ring->next = _apportable_trace_rings;
+        _apportable_trace_rings = ring;
+        apportable_unlock(&_apportable_trace_lock);
+        _apportable_trace_mine = ring;
+    }
+    head = ring->head;
+    if (((head - apportable_load_int(&ring->tail)) & APPORTABLE_TRACE_WRAP) == APPORTABLE_TRACE_EVENTS) {
+        ring->dropped++;
+        return;
+    }
+    ev = &ring->ev[head & (APPORTABLE_TRACE_EVENTS - 1)];
+    ev->name = name;
+    ev->ns = _apportable_trace_now();
+    ev->ph = ph;
+    apportable_store_int(&ring->head, (head + 1) & APPORTABLE_TRACE_WRAP);
+}
+
+long apportable_trace_write (const char * path)
+{
+    struct apportable_trace_ring * ring;
+    struct apportable_trace_event * ev;
+    FILE * f;
+    long count, dropped, pid;
+    int tail, head;
+
+    if (!path || !(f = fopen(path, "w")))
+        return -1;
+#if defined _WIN32
+    pid = (long) GetCurrentProcessId();
+#else
+    pid = (long) getpid();
+#endif
+    count = dropped = 0;
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [");
+    apportable_lock(&_apportable_trace_lock);
+    for (ring = _apportable_trace_rings; ring; ring = ring->next) {
+        head = apportable_load_int(&ring->head);
+        for (tail = ring->tail; tail != head; tail = (tail + 1) & APPORTABLE_TRACE_WRAP) {
+            ev = &ring->ev[tail & (APPORTABLE_TRACE_EVENTS - 1)];
+            /* names are literals of plain ASCII, nothing to escape */
+            fprintf(f, "%s\n{\"name\": \"%s\", \"cat\": \"apportable\", \"ph\": \"%c\", \"ts\": %llu.%03llu, \"pid\": %ld, \"tid\": %ld}",
+                    count++ ? "," : "", ev->name, ev->ph, ev->ns / 1000, ev->ns % 1000, pid, ring->tid);
+        }
+        apportable_store_int(&ring->tail, tail);
+        dropped += ring->dropped;
+    }
+    apportable_unlock(&_apportable_trace_lock);
+    fprintf(f, "\n], \"otherData\": {\"dropped\": %ld}}\n", dropped);
+    if (fclose(f) != 0)
+        return -1;
+    return count;
+}
+
+#else /*APPORTABLE_TRACE*/
+
+# define APPORTABLE_TRACE_BEGIN(name) ((void) 0)
+# define APPORTABLE_TRACE_END(name) ((void) 0)
+
+long apportable_trace_write (const char * path)
+{
+    (void) path;
+    return -1;
+}
+
+#endif /*APPORTABLE_TRACE*/
+
+
+/* Results of the _into functions: the size needed (terminator included)
+ * goes to *needed, and the result to buf if it fits.  A NULL return with
+ * *needed == 0 means there is no result at all. */
+static char * _apportable_put (const char * s, size_t s_l, char * buf, size_t cap, size_t * needed)
+{
+    if (needed)
+        *needed = s_l + 1;
+    if (!buf || cap < s_l + 1)
+        return NULL;
+    memcpy(buf, s, s_l);
+    buf[s_l] = 0;
+    return buf;
+}
+
+#if defined _WIN32
+/* same for a result some allocating function produced, which is freed */
+static char * _apportable_put_free (apportable self, char * s, char * buf, size_t cap, size_t * needed)
+{
+    char * ret;
+
+    if (!s) {
+        if (needed)
+            *needed = 0;
+        return NULL;
+    }
+    ret = _apportable_put(s, strlen(s), buf, cap, needed);
+    mem_free(self, s);
+    return ret;
+}
+#endif
+
+static char * _apportable_dup (apportable self, const char * s, size_t size)
+{
+    char * ret;
+
+    if ((ret = mem_calloc(self, char, size)))
+        memcpy(ret, s, size);
+    return ret;
+}
+
+/* the last directory separator in s[0..n), or NULL */
+static const char * _apportable_lastsep (const char * s, size_t n)
+{
+    while (n--)
+        if (s[n] == DIRSEP_C)
+            return s + n;
+    return NULL;
+}
+
+/* FNV-1a, for the hash tables of the caches */
+static size_t _apportable_hash (const char * s, size_t n)
+{
+    size_t h = (size_t) 2166136261u;
+
+    while (n--)
+        h = (h ^ (unsigned char) *s++) * 16777619u;
+    return h;
+}
+
+/* Body of an allocating function wrapping an _into one: produce the result
+ * on the stack and return an exact copy, or go to the heap if it is longer. */
+#define APPORTABLE_INTO_ALLOC(self, fn, ...) do { \
+        char _buf[APPORTABLE_PATHBUF], * _ret; \
+        size_t _cap, _needed; \
+        _cap = sizeof(_buf); \
+        if ((self)->fn((self), __VA_ARGS__, _buf, _cap, &_needed)) \
+            return _apportable_dup((self), _buf, _needed); \
+        while (_needed > _cap && (_ret = mem_calloc((self), char, _needed))) { \
+            _cap = _needed; \
+            if ((self)->fn((self), __VA_ARGS__, _ret, _cap, &_needed)) \
+                return _ret; \
+            mem_free((self), _ret); \
+        } \
+        return NULL; \
+    } while (0)
+
+/* the same for the _sv variants, around an _into function taking self:
+ * the result and its length, p NULL if there is none */
+#define APPORTABLE_INTO_ALLOC_SV(self, fn, ...) do { \
+        char _buf[APPORTABLE_PATHBUF], * _ret; \
+        size_t _cap, _needed; \
+        apportable_sv _sv = {NULL, 0}; \
+        _cap = sizeof(_buf); \
+        if (fn((self), __VA_ARGS__, _buf, _cap, &_needed)) { \
+            if ((_sv.p = _apportable_dup((self), _buf, _needed))) \
+                _sv.n = _needed - 1; \
+            return _sv; \
+        } \
+        while (_needed > _cap && (_ret = mem_calloc((self), char, _needed))) { \
+            _cap = _needed; \
+            if (fn((self), __VA_ARGS__, _ret, _cap, &_needed)) { \
+                _sv.p = _ret; \
+                _sv.n = _needed - 1; \
+                return _sv; \
+            } \
+            mem_free((self), _ret); \
+        } \
+        return _sv; \
+    } while (0)
+
+
+
+/* UTF-8 code point counting, for _strndup */
+
+#if defined APPORTABLE_X86_SIMD
+
+/* Count lead bytes (anything but 10xxxxxx) a block at a time, as long as
+ * the total stays within limit; returns the number of bytes consumed. */
+__attribute__((target("sse2"), always_inline))
+static inline size_t _apportable_utf8_leads_sse2 (const unsigned char * s, size_t n, size_t * count, size_t limit)
+{
+    __m128i cont;
+    size_t i, c;
+    unsigned int m;
+
+    cont = _mm_set1_epi8((char) 0xBF);   /* signed: 0x80..0xBF is <= -65 */
+    c = *count;
+    for (i = 0; i + 16 <= n; i += 16) {
+        m = _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_loadu_si128((const __m128i *) (s + i)), cont));
+        if (c + __builtin_popcount(m) > limit)
+            break;
+        c += __builtin_popcount(m);
+    }
+    *count = c;
+    return i;
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t _apportable_utf8_leads_avx2 (const unsigned char * s, size_t n, size_t * count, size_t limit)
+{
+    __m256i cont;
+    size_t i, c;
+    unsigned int m;
+
+    cont = _mm256_set1_epi8((char) 0xBF);
+    c = *count;
+    for (i = 0; i + 32 <= n; i += 32) {
+        m = _mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_loadu_si256((const __m256i *) (s + i)), cont));
+        if (c + __builtin_popcount(m) > limit)
+            break;
+        c += __builtin_popcount(m);
+    }
+    *count = c;
+    return i + _apportable_utf8_leads_sse2(s + i, n - i, count, limit);
+}
+
+static size_t _apportable_utf8_leads_sse2_fn (const unsigned char * s, size_t n, size_t * count, size_t limit)
+{
+    return _apportable_utf8_leads_sse2(s, n, count, limit);
+}
+
+#endif /*APPORTABLE_X86_SIMD*/
+
+static size_t (*_apportable_utf8_leads) (const unsigned char *, size_t, size_t *, size_t) = NULL;
+
+
+/* byte length of the first syms code points of s[0..n) */
+static size_t _apportable_utf8_span (const char * str, size_t n, size_t syms)
+{
+    const unsigned char * s = (const unsigned char *) str;
+    size_t i, count;
+
+    i = count = 0;
+    /* only worth a call for longer strings */
+    if (_apportable_utf8_leads && n >= 64)
+        i = _apportable_utf8_leads(s, n, &count, syms);
+    for (; i < n; i++) {
+        if ((s[i] & 0xC0) == 0x80)
+            continue;
+        if (count == syms)
+            break;
+        count++;
+    }
+    return i;
+}
+
+
+/* pick the vectorized helpers once; racing callers store the same values */
+static void _apportable_simd_dispatch (void)
+{
+#if defined APPORTABLE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        _apportable_utf8_leads = &_apportable_utf8_leads_avx2;
+# if defined APPORTABLE_NATIVE_UTF
+        _apportable_ascii_widen = &_apportable_ascii_widen_avx2;
+        _apportable_ascii_narrow = &_apportable_ascii_narrow_avx2;
+# endif
+    } else if (__builtin_cpu_supports("sse2")) {
+        _apportable_utf8_leads = &_apportable_utf8_leads_sse2_fn;
+# if defined APPORTABLE_NATIVE_UTF
+        _apportable_ascii_widen = &_apportable_ascii_widen_sse2;
+        _apportable_ascii_narrow = &_apportable_ascii_narrow_sse2;
+# endif
+    }
+#endif
+}
+
+
+
+/* copy of the first syms code points (all if 0), never leaving UTF-8 */
+char * apportable_strndup(apportable a, const char * str, size_t syms)
+{
+    apportable self;
+    char * ret;
+    size_t len;
+
+    self = APPORTABLE_STATE(a);
+    if (str == NULL)
+        return NULL;
+
+    len = strlen(str);
+    if (syms != 0)
+        len = _apportable_utf8_span(str, len, syms);
+    if ((ret = mem_calloc(self, char, len + 1)))
+        memcpy(ret, str, len);
+    return ret;
+}
+
+
+wchar_t * apportable_wcsndup(apportable a, const wchar_t * str, size_t syms)
+{
+    apportable self;
+    wchar_t * buffer;
+    size_t buflen;
+
+    self = APPORTABLE_STATE(a);
+    if (str == NULL)
+        return NULL;
+    buflen = wcslen(str);
+    if (syms == 0 || syms > buflen)
+        syms = buflen;
+    if ((buffer = mem_calloc(self, wchar_t, syms + 1)))
+        wmemcpy(buffer, str, syms);
+    return buffer;
+}
+
+
+/* Environment snapshot
+ *
+ * After apportable_env_refresh, lookups go to a hash table of a copy of
+ * the environment instead of scanning it, and return views into that
+ * copy.  A refresh publishes a new table; the previous ones stay valid
+ * (and are chained for apportable_fini) so readers take no lock. */
+
+#if defined __APPLE__
+# include <crt_externs.h>
+# define apportable_environ (*_NSGetEnviron())
+#elif !defined _WIN32
+extern char ** environ;
+# define apportable_environ environ
+#endif
+
+struct apportable_env_slot
+{
+    apportable_sv name;   /* name.p NULL for a free slot */
+    apportable_sv value;
+    size_t hash;
+};
+
+struct apportable_env
+{
+    struct apportable_env * older;
+    size_t mask;
+    struct apportable_env_slot slots[1];   /* mask + 1, then the strings */
+};
+
+
+/* names are case-insensitive on Windows */
+static size_t _apportable_env_hash (const char * s, size_t n)
+{
+#if defined _WIN32
+    size_t h = (size_t) 2166136261u;
+
+    while (n--)
+        h = (h ^ (unsigned char) (*s >= 'a' && *s <= 'z' ? *s++ - 'a' + 'A' : *s++)) * 16777619u;
+    return h;
+#else
+    return _apportable_hash(s, n);
+#endif
+}
+
+static const struct apportable_env_slot * _apportable_env_find (const struct apportable_env * env, const char * name, size_t name_l)
+{
+    const struct apportable_env_slot * slot;
+    size_t hash, i;
+
+    hash = _apportable_env_hash(name, name_l);
+    for (i = hash & env->mask; (slot = &env->slots[i])->name.p; i = (i + 1) & env->mask)
+#if defined _WIN32
+        if (slot->hash == hash && slot->name.n == name_l && !_strnicmp(slot->name.p, name, name_l))
+#else
+        if (slot->hash == hash && slot->name.n == name_l && !memcmp(slot->name.p, name, name_l))
+#endif
+            return slot;
+    return NULL;
+}
+
+/* copy of entries, "NAME=value" in UTF-8, into a new table */
+static struct apportable_env * _apportable_env_build (apportable self, char ** entries)
+{
+    struct apportable_env * env;
+    struct apportable_env_slot * slot;
+    const char * eq;
+    size_t count, text_l, mask, entry_l, name_l, i, j;
+    char * text;
+
+    count = text_l = 0;
+    for (i = 0; entries[i]; i++) {
+        count++;
+        text_l += strlen(entries[i]) + 1;
+    }
+    for (mask = 15; mask + 1 < 2 * count; mask = 2 * mask + 1)
+        ;
+    if (!(env = self->_calloc(1, sizeof(*env) + mask * sizeof(*env->slots) + text_l)))
+        return NULL;
+    env->mask = mask;
+    text = (char *) &env->slots[mask + 1];
+    for (i = 0; entries[i] && i < count; i++) {
+        entry_l = strlen(entries[i]);
+        /* Windows keeps per-drive directories as "=C:=C:\..." */
+        if (!(eq = strchr(entries[i] + 1, '=')) || entry_l + 1 > text_l)
+            continue;
+        memcpy(text, entries[i], entry_l + 1);
+        name_l = eq - entries[i];
+        if (!_apportable_env_find(env, text, name_l)) {
+            /* the first one counts, as for getenv */
+            for (j = _apportable_env_hash(text, name_l) & mask; (slot = &env->slots[j])->name.p; j = (j + 1) & mask)
+                ;
+            slot->name.p = text;
+            slot->name.n = name_l;
+            slot->value.p = text + name_l + 1;
+            slot->value.n = entry_l - name_l - 1;
+            slot->hash = _apportable_env_hash(text, name_l);
+        }
+        text += entry_l + 1;
+        text_l -= entry_l + 1;
+    }
+    return env;
+}
+
+static void _apportable_env_free (apportable self)
+{
+    struct apportable_env * env, * older;
+
+    for (env = self->_env; env; env = older) {
+        older = env->older;
+        self->_free(env);
+    }
+    self->_env = NULL;
+}
+
+int apportable_env_refresh (apportable a)
+{
+    apportable self;
+    struct apportable_env * env;
+    char ** entries;
+#if defined _WIN32
+    wchar_t * block, * w;
+    char * utf8, * u;
+    size_t count, block_l, utf8_l, i;
+#endif
+
+    self = APPORTABLE_STATE(a);
+#if defined _WIN32
+    /* the environment block, as UTF-8 strings */
+    if (!(block = GetEnvironmentStringsW()))
+        return -1;
+    for (count = 0, w = block; *w; w += wcslen(w) + 1)
+        count++;
+    block_l = w - block + 1;
+    utf8_l = WideCharToMultiByte(CP_UTF8, 0, block, block_l, NULL, 0, NULL, NULL);
+    entries = mem_calloc(self, char *, count + 1);
+    utf8 = mem_calloc(self, char, utf8_l);
+    if (!entries || !utf8 || !WideCharToMultiByte(CP_UTF8, 0, block, block_l, utf8, utf8_l, NULL, NULL)) {
+        FreeEnvironmentStringsW(block);
+        mem_free(self, utf8);
+        mem_free(self, entries);
+        return -1;
+    }
+    FreeEnvironmentStringsW(block);
+    for (i = 0, u = utf8; i < count; u += strlen(u) + 1)
+        entries[i++] = u;
+    env = _apportable_env_build(self, entries);
+    mem_free(self, utf8);
+    mem_free(self, entries);
+#else
+    entries = apportable_environ;
+    env = entries ? _apportable_env_build(self, entries) : NULL;
+#endif
+    if (!env)
+        return -1;
+    apportable_lock(&self->_env_lock);
+    env->older = self->_env;
+    apportable_store_ptr(&self->_env, env);
+    apportable_unlock(&self->_env_lock);
+    return 0;
+}
+
+apportable_sv apportable_env (apportable a, const char * name)
+{
+    apportable self;
+    apportable_sv sv;
+
+    self = APPORTABLE_STATE(a);
+    sv.p = NULL;
+    sv.n = 0;
+    if (!name)
+        return sv;
+#if !defined _WIN32
+    if (!apportable_load_ptr(&self->_env)) {
+        /* name is terminated, getenv takes it as is */
+        if ((sv.p = getenv(name)))
+            sv.n = strlen(sv.p);
+        return sv;
+    }
+#endif
+    sv.p = name;
+    sv.n = strlen(name);
+    return apportable_env_sv(self, sv);
+}
+
+apportable_sv apportable_env_sv (apportable a, apportable_sv name)
+{
+    apportable self;
+    struct apportable_env * env;
+    const struct apportable_env_slot * slot;
+    apportable_sv ret;
+#if defined _WIN32
+    wchar_t * wvar, * wval;
+    char * val;
+    int wvar_l, val_l;
+#else
+    char * var;
+#endif
+
+    self = APPORTABLE_STATE(a);
+    ret.p = NULL;
+    ret.n = 0;
+    if (!name.p)
+        return ret;
+    if ((env = apportable_load_ptr(&self->_env))) {
+        if ((slot = _apportable_env_find(env, name.p, name.n)))
+            ret = slot->value;
+        return ret;
+    }
+#if defined _WIN32
+    /* getenv would not give UTF-8: _wgetenv, and the value converted into
+     * the thread's buffer, where it stays until the buffer's next use */
+    if (memchr(name.p, 0, name.n) || name.n > INT_MAX)
+        return ret;
+    wvar_l = MultiByteToWideChar(CP_UTF8, 0, name.p, (int) name.n, NULL, 0);
+    if (!(wvar = _apportable_scratch(self, (wvar_l + 1) * sizeof(wchar_t))))
+        return ret;
+    MultiByteToWideChar(CP_UTF8, 0, name.p, (int) name.n, wvar, wvar_l);
+    wvar[wvar_l] = 0;
+    wval = _wgetenv(wvar);
+    _apportable_scratch_done(self, wvar);
+    if (!wval || !(val_l = WideCharToMultiByte(CP_UTF8, 0, wval, -1, NULL, 0, NULL, NULL))
+            || !(val = _apportable_scratch_get(self, val_l)))
+        return ret;
+    WideCharToMultiByte(CP_UTF8, 0, wval, -1, val, val_l, NULL, NULL);
+    _apportable_scratch_done(self, val);   /* lent out, not busy */
+    ret.p = val;
+    ret.n = val_l - 1;
+#else
+    /* getenv wants it terminated */
+    if (memchr(name.p, 0, name.n) || !(var = _apportable_scratch(self, name.n + 1)))
+        return ret;
+    memcpy(var, name.p, name.n);
+    var[name.n] = 0;
+    if ((ret.p = getenv(var)))
+        ret.n = strlen(ret.p);
+    _apportable_scratch_done(self, var);
+#endif
+    return ret;
+}
+
+
+#ifdef _WIN32
+
+char * apportable_wutf8 (apportable a, const wchar_t * s)
+{
+    apportable self;
+    char * b;
+    size_t s_l, b_l;
+
+    self = APPORTABLE_STATE(a);
+    if (s == NULL)
+        return NULL;
+    s_l = wcslen(s);
+    b_l = WideCharToMultiByte(CP_UTF8, 0, s, s_l, NULL, 0, NULL, NULL);
+    b = mem_calloc(self, wchar_t, b_l + 1);
+    WideCharToMultiByte(CP_UTF8, 0, s, s_l, b, b_l, NULL, NULL);
+    return b;
+}
+
+char * apportable_wutf8_free(apportable a, wchar_t * s)
+{
+    apportable self;
+    char * ret;
+
+    self = APPORTABLE_STATE(a);
+    ret = self->wutf8(self, s);
+    mem_free(self, s);
+    return ret;
+}
+
+
+wchar_t * apportable_uwchar_t (apportable a, const char * s)
+{
+    apportable self;
+    char * b;
+    size_t s_l, b_l;
+
+    self = APPORTABLE_STATE(a);
+    if (s == NULL)
+        return NULL;
+    s_l = strlen(s) + 1;
+    b_l = MultiByteToWideChar(CP_UTF8, 0, s, s_l, NULL, 0);
+    b = mem_calloc(self, wchar_t, b_l + 0);
+    MultiByteToWideChar(CP_UTF8, 0, s, s_l, b, b_l);
+    return b;
+}
+
+wchar_t * apportable_uwchar_t_free (apportable a, const char * s)
+{
+    apportable self;
+    char * ret;
+
+    self = APPORTABLE_STATE(a);
+    ret = self->uwchar_t(self, s);
+    mem_free(self, s);
+    return ret;
+}
+
+
+
+char * apportable_ugetenv (apportable a, const char * var)
+{
+    apportable self;
+    const struct apportable_env_slot * slot;
+    struct apportable_env * env;
+    wchar_t * v;
+    char * ret;
+    size_t var_l, v_l;
+
+    self = APPORTABLE_STATE(a);
+    if ((env = apportable_load_ptr(&self->_env))) {
+        slot = _apportable_env_find(env, var, strlen(var));
+        return slot ? _apportable_dup(self, slot->value.p, slot->value.n + 1) : _apportable_dup(self, "", 1);
+    }
+    var_l = strlen(var) + 1;
+    v_l = MultiByteToWideChar(CP_UTF8, 0, var, var_l, NULL, 0);
+    if (!(v = _apportable_scratch(self, v_l * sizeof(wchar_t))))
+        return NULL;
+    MultiByteToWideChar(CP_UTF8, 0, var, var_l, v, v_l);
+    ret = self->wutf8(self, _wgetenv(v));
+    _apportable_scratch_done(self, v);
+    return ret;
+}
+
+char * apportable_wugetenv (apportable a, const wchar_t * var)
+{
+    apportable self;
+    const struct apportable_env_slot * slot;
+    struct apportable_env * env;
+    char * v;
+    int v_l;
+
+    self = APPORTABLE_STATE(a);
+    if ((env = apportable_load_ptr(&self->_env))) {
+        /* the copy is by UTF-8 name */
+        v_l = WideCharToMultiByte(CP_UTF8, 0, var, -1, NULL, 0, NULL, NULL);
+        if (!v_l || !(v = _apportable_scratch(self, v_l)))
+            return NULL;
+        WideCharToMultiByte(CP_UTF8, 0, var, -1, v, v_l, NULL, NULL);
+        slot = _apportable_env_find(env, v, v_l - 1);
+        _apportable_scratch_done(self, v);
+        return slot ? _apportable_dup(self, slot->value.p, slot->value.n + 1) : _apportable_dup(self, "", 1);
+    }
+    return self->wutf8(self, _wgetenv(var));
+}
+
+char * apportable_ugetenv_into (apportable a, char * var, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    return _apportable_put_free(self, self->ugetenv(self, var), buf, cap, needed);
+}
+
+char * apportable_wugetenv_into (apportable a, wchar_t * wvar, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    return _apportable_put_free(self, self->wugetenv(self, wvar), buf, cap, needed);
+}
+
+
+
+
+#else /*!_WIN32*/
+
+#if !defined APPORTABLE_NATIVE_UTF
+
+/* Borrow the descriptor opened by apportable_init for one conversion.
+ * An iconv_t carries shift state and must not be used by two threads at
+ * once, so a caller finding it busy (or never opened) gets a private one. */
+static iconv_t _apportable_iconv_acquire (apportable self, int which, const char * tocode, const char * fromcode)
+{
+    iconv_t cd;
+
+    if (self->_iconv[which] && apportable_trylock(&self->_iconv_lock[which])) {
+        cd = (iconv_t) self->_iconv[which];
+        iconv(cd, NULL, NULL, NULL, NULL);   /* reset to the initial state */
+        return cd;
+    }
+    APPORTABLE_TRACE_BEGIN("iconv_open");
+    cd = iconv_open(tocode, fromcode);
+    APPORTABLE_TRACE_END("iconv_open");
+    return cd;
+}
+
+static void _apportable_iconv_release (apportable self, int which, iconv_t cd)
+{
+    if (cd == (iconv_t) self->_iconv[which])
+        apportable_unlock(&self->_iconv_lock[which]);
+    else
+        iconv_close(cd);
+}
+
+/* Convert the in_l bytes at in into the calling thread's scratch, which
+ * must take out_cap bytes, and terminate it; the length of the result in
+ * bytes goes to *out_l.  Hand it back with _apportable_scratch_done. */
+static char * _apportable_iconv_scratch (apportable self, int which, const char * tocode, const char * fromcode,
+        const char * in, size_t in_l, size_t out_cap, size_t * out_l)
+{
+    char * out;
+    /* iconv expects in-out params */
+    char * iconv_in, * iconv_out;
+    size_t iconv_in_l, iconv_out_l;
+    iconv_t iconv_obj;
+
+    if (!(out = _apportable_scratch(self, out_cap + sizeof(wchar_t))))
+        return NULL;
+    iconv_obj = _apportable_iconv_acquire(self, which, tocode, fromcode);
+    if (iconv_obj == (iconv_t) -1) {
+        _apportable_scratch_done(self, out);
+        return NULL;
+    }
+    iconv_in = (char *) in, iconv_out = out;
+    iconv_in_l = in_l, iconv_out_l = out_cap;
+    APPORTABLE_TRACE_BEGIN("iconv");
+    iconv(iconv_obj, &iconv_in, &iconv_in_l, &iconv_out, &iconv_out_l);
+    APPORTABLE_TRACE_END("iconv");
+    _apportable_iconv_release(self, which, iconv_obj);
+    *out_l = out_cap - iconv_out_l;
+    memset(out + *out_l, 0, sizeof(wchar_t));
+    return out;
+}
+
+#endif /*APPORTABLE_NATIVE_UTF*/
+
+
+char * apportable_wutf8 (apportable a, const wchar_t * s)
+{
+#if defined APPORTABLE_NATIVE_UTF
+    apportable self;
+    char * ret;
+    size_t s_l, ret_l;
+
+    self = APPORTABLE_STATE(a);
+    s_l = wcslen(s);
+    ret_l = _apportable_utf8_encode(NULL, s, s_l);
+    if ((ret = mem_calloc(self, char, ret_l + 1)))
+        _apportable_utf8_encode(ret, s, s_l);
+    return ret;
+#else
+    apportable self;
+    char * buffer, * ret;
+    size_t s_l, buffer_l;
+
+    self = APPORTABLE_STATE(a);
+    s_l = wcslen(s);
+    /* four bytes at most for a UTF-32 unit or a UTF-16 pair */
+    if (!(buffer = _apportable_iconv_scratch(self, APPORTABLE_ICONV_WUTF8, "UTF-8", self->_iconv_wchar_t,
+            (const char *) s, s_l * sizeof(wchar_t), s_l * 4, &buffer_l)))
+        return NULL;
+    ret = _apportable_dup(self, buffer, buffer_l + 1);
+    _apportable_scratch_done(self, buffer);
+    return ret;
+#endif
+}
+
+char * apportable_wutf8_free (apportable a, wchar_t * s)
+{
+    apportable self;
+    char * ret;
+
+    self = APPORTABLE_STATE(a);
+    ret = self->wutf8(self, s);
+    mem_free(self, s);
+    return ret;
+}
+
+#if defined APPORTABLE_NATIVE_UTF
+char * apportable_wutf8_into (apportable a, const wchar_t * s, char * buf, size_t cap, size_t * needed)
+{
+    size_t s_l, ret_l;
+
+    APPORTABLE_STATE(a);
+    s_l = wcslen(s);
+    ret_l = _apportable_utf8_encode(NULL, s, s_l);
+    if (needed)
+        *needed = ret_l + 1;
+    if (!buf || cap < ret_l + 1)
+        return NULL;
+    _apportable_utf8_encode(buf, s, s_l);
+    buf[ret_l] = 0;
+    return buf;
+}
+#else
+char * apportable_wutf8_into (apportable a, const wchar_t * s, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+    char * buffer;
+    size_t s_l, buffer_l;
+
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    s_l = wcslen(s);
+    if (!(buffer = _apportable_iconv_scratch(self, APPORTABLE_ICONV_WUTF8, "UTF-8", self->_iconv_wchar_t,
+            (const char *) s, s_l * sizeof(wchar_t), s_l * 4, &buffer_l)))
+        return NULL;
+    buf = _apportable_put(buffer, buffer_l, buf, cap, needed);
+    _apportable_scratch_done(self, buffer);
+    return buf;
+}
+#endif
+
+
+
+wchar_t * apportable_uwchar_t (apportable a, const char * s)
+{
+#if defined APPORTABLE_NATIVE_UTF
+    apportable self;
+    wchar_t * ret;
+    size_t s_l, ret_l;
+
+    self = APPORTABLE_STATE(a);
+    s_l = strlen(s);
+    ret_l = _apportable_utf8_decode(NULL, s, s_l);
+    if ((ret = mem_calloc(self, wchar_t, ret_l + 1)))
+        _apportable_utf8_decode(ret, s, s_l);
+    return ret;
+#else
+    apportable self;
+    wchar_t * ret;
+    wchar_t * buffer;
+    size_t s_l, buffer_l;
+
+    self = APPORTABLE_STATE(a);
+    s_l = strlen(s);
+    if (!(buffer = (wchar_t *) _apportable_iconv_scratch(self, APPORTABLE_ICONV_UWCHAR_T, self->_iconv_wchar_t, "UTF-8",
+            s, s_l, s_l * sizeof(wchar_t), &buffer_l)))
+        return NULL;
+    buffer_l /= sizeof(wchar_t);
+    if ((ret = mem_calloc(self, wchar_t, buffer_l + 1)))
+        wmemcpy(ret, buffer, buffer_l);
+    _apportable_scratch_done(self, buffer);
+    return ret;
+#endif
+}
+
+wchar_t * apportable_uwchar_t_free (apportable a, char * s)
+{
+    apportable self;
+    wchar_t * ret;
+
+    self = APPORTABLE_STATE(a);
+    ret = self->uwchar_t(self, s);
+    mem_free(self, s);
+    return ret;
+}
+
+#if defined APPORTABLE_NATIVE_UTF
+wchar_t * apportable_uwchar_t_into (apportable a, const char * s, wchar_t * buf, size_t cap, size_t * needed)
+{
+    size_t s_l, ret_l;
+
+    APPORTABLE_STATE(a);
+    s_l = strlen(s);
+    ret_l = _apportable_utf8_decode(NULL, s, s_l);
+    if (needed)
+        *needed = ret_l + 1;
+    if (!buf || cap < ret_l + 1)
+        return NULL;
+    _apportable_utf8_decode(buf, s, s_l);
+    buf[ret_l] = 0;
+    return buf;
+}
+#else
+wchar_t * apportable_uwchar_t_into (apportable a, const char * s, wchar_t * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+    wchar_t * buffer;
+    size_t s_l, buffer_l;
+
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    s_l = strlen(s);
+    if (!(buffer = (wchar_t *) _apportable_iconv_scratch(self, APPORTABLE_ICONV_UWCHAR_T, self->_iconv_wchar_t, "UTF-8",
+            s, s_l, s_l * sizeof(wchar_t), &buffer_l)))
+        return NULL;
+    buffer_l /= sizeof(wchar_t);
+    if (needed)
+        *needed = buffer_l + 1;
+    if (buf && cap >= buffer_l + 1)
+        wmemcpy(buf, buffer, buffer_l + 1);
+    else
+        buf = NULL;
+    _apportable_scratch_done(self, buffer);
+    return buf;
+}
+#endif
+
+
+
+
+char * apportable_ugetenv (apportable a, char * var)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    APPORTABLE_INTO_ALLOC(self, ugetenv_into, var);
+}
+
+char * apportable_ugetenv_into (apportable a, char * var, char * buf, size_t cap, size_t * needed)
+{
+    apportable_sv val;
+
+    val = apportable_env(a, var);
+    if (!val.p)
+        val.p = "";
+    return _apportable_put(val.p, val.n, buf, cap, needed);
+}
+
+char * apportable_wugetenv (apportable a, wchar_t * wvar)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    APPORTABLE_INTO_ALLOC(self, wugetenv_into, wvar);
+}
+
+char * apportable_wugetenv_into (apportable a, wchar_t * wvar, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+    char * var, * ret;
+    size_t var_l;
+
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    /* the name only lives for the lookup */
+    var_l = wcslen(wvar);
+#if defined APPORTABLE_NATIVE_UTF
+    if (!(var = _apportable_scratch(self, 4 * var_l + 1)))
+        return NULL;
+    var[_apportable_utf8_encode(var, wvar, var_l)] = 0;
+#else
+    if (!(var = _apportable_iconv_scratch(self, APPORTABLE_ICONV_WUTF8, "UTF-8", self->_iconv_wchar_t,
+            (const char *) wvar, var_l * sizeof(wchar_t), var_l * 4, &var_l)))
+        return NULL;
+#endif
+    ret = self->ugetenv_into(self, var, buf, cap, needed);
+    _apportable_scratch_done(self, var);
+    return ret;
+}
+
+#endif
+
+
+#if defined _WIN32
+
+/* the platform converters only allocate, copy their result out */
+char * apportable_wutf8_into (apportable a, const wchar_t * s, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    return _apportable_put_free(self, self->wutf8(self, s), buf, cap, needed);
+}
+
+wchar_t * apportable_uwchar_t_into (apportable a, const char * s, wchar_t * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+    wchar_t * ws;
+    size_t ws_l;
+
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    if (!(ws = self->uwchar_t(self, s)))
+        return NULL;
+    ws_l = wcslen(ws);
+    if (needed)
+        *needed = ws_l + 1;
+    if (buf && cap >= ws_l + 1)
+        wmemcpy(buf, ws, ws_l + 1);
+    else
+        buf = NULL;
+    mem_free(self, ws);
+    return buf;
+}
+
+#endif
+
+
+/* The program's own path and $ORIGIN, found once per process (see
+ * apportable_exepath) and never changed after; path and origin point into
+ * buf, or are NULL if the program could not be found. */
+struct apportable_exe
+{
+    volatile int state;   /* 0 not taken, -1 being taken, 1 taken */
+    const char * path;
+    const char * origin;
+    size_t path_l, origin_l;
+    char buf[2 * APPORTABLE_PATHBUF];
+};
+
+static struct apportable_exe _apportable_exe;
+
+
+
+#ifdef _WIN32
+
+/* for UTF-16 "wide" character */
+wchar_t * apportable_wprogfile (apportable a, const wchar_t * library_name) {
+    apportable self;
+	wchar_t * ret;
+	HMODULE handle;
+    wchar_t * wfile;
+    wchar_t * file;
+
+    self = APPORTABLE_STATE(a);
+    if (!self->enabled)
+        return self->_wcsndup(self, library_name, 0);
+
+    ret = NULL;
+    handle = NULL;
+    if (!GetModuleHandleExW(0, library_name, &handle)) {
         if (handle)
             FreeLibrary(handle);
         return NULL;
     }
-    wfile = self->_calloc(sizeof(WCHAR), MAX_PATH);
-    file = self->_calloc(sizeof(char), MAX_PATH);
-    if (GetModuleFileNameW(handle, wfile, MAX_PATH))
-	    ret = file;
-	self->_free(wfile);
-	if (!ret)
-		self->_free(file);
-	FreeLibrary(handle);
-	return ret;
+    wfile = mem_calloc(self, WCHAR, MAX_PATH);
+    file = mem_calloc(self, char, MAX_PATH);
+    if (GetModuleFileNameW(handle, wfile, MAX_PATH))
+	    ret = file;
+	mem_free(self, wfile);
+	if (!ret)
+		mem_free(self, file);
+	FreeLibrary(handle);
+	return ret;
+}
+
+/* for utf-8, will call into native UTF-16 */
+char * apportable_progfile (apportable a, const char * library_name) {
+    apportable self;
+    self = APPORTABLE_STATE(a);
+    if (!self->enabled)
+        return self->_strndup(a, (const char *)library_name, 0);
+
+	char * ret = NULL;
+    PWSTR wlibnam;
+    size_t ln_l, wlibnam_l;
+	if (library_name == NULL)
+		return apportable_wprogfile (self, NULL);
+    ln_l = strlen(library_name) + 1;
+    wlibnam_l = MultiByteToWideChar (CP_UTF8, 0, library_name, ln_l, NULL, 0);
+    wlibnam = mem_calloc(self, char, wlibnam_l + 0);
+	if (!MultiByteToWideChar (CP_UTF8, 0, library_name, ln_l, wlibnam, wlibnam_l))
+    {
+		mem_free(self, wlibnam);
+		return NULL;			
+	}
+	ret = apportable_wprogfile (a, wlibnam);
+	mem_free(self, wlibnam);
+	return ret;
+}
+
+char * apportable_progfile_into (apportable a, const char * library_name, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    return _apportable_put_free(self, apportable_progfile(self, library_name), buf, cap, needed);
+}
+
+char * apportable_progfile_for_address_into (apportable a, const void * addr, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+    HMODULE handle;
+    wchar_t wfile[MAX_PATH];
+    char file[APPORTABLE_PATHBUF];
+    DWORD l;
+
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    if (!self->enabled || !addr || !GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS
+            | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCWSTR) addr, &handle))
+        return NULL;
+    if (!(l = GetModuleFileNameW(handle, wfile, MAX_PATH)) || l >= MAX_PATH
+            || !(l = WideCharToMultiByte(CP_UTF8, 0, wfile, l + 1, file, sizeof(file), NULL, NULL)))
+        return NULL;
+    return _apportable_put(file, l - 1, buf, cap, needed);
+}
+
+#elif defined __APPLE__
+
+char * apportable_progfile_into (apportable a, const char * library_name, char * buf, size_t cap, size_t * needed) {
+    apportable self;
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    if (!self->enabled)
+        return library_name ? _apportable_put(library_name, strlen(library_name), buf, cap, needed) : NULL;
+
+    const char* library_base_name = library_name ? strrchr(library_name, DIRSEP_C) : NULL;
+    if (!library_base_name)
+        library_base_name = library_name;
+    else
+        library_base_name += 1;   // skip found '/'
+    char* library_file = NULL;   /* stays NULL if not found or buf too small */
+
+    const char * image_name = NULL;
+    const char * library_name_sep = NULL;
+    unsigned long image_count = _dyld_image_count();
+    errno = 0;
+    for (unsigned long i = 0; i < image_count; i++) {
+        image_name = (const char *)_dyld_get_image_name(i);  // dyld owns string
+        if (!image_name || !image_name[0])
+            continue;
+        library_name_sep = strrchr(image_name, '/');
+        if (!library_name_sep)
+            library_name_sep = image_name;
+       	else
+       		library_name_sep += 1;   // skip found '/'
+        if (!library_name || !strcmp(library_name_sep, library_base_name)) {
+            library_file = _apportable_put(image_name, strlen(image_name), buf, cap, needed);
+            break;
+        }
+    }
+    return library_file;
+}
+
+/* dyld keeps its own index of the images */
+char * apportable_progfile_for_address_into (apportable a, const void * addr, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+    Dl_info info;
+
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    if (!self->enabled || !addr || !dladdr(addr, &info) || !info.dli_fname)
+        return NULL;
+    return _apportable_put(info.dli_fname, strlen(info.dli_fname), buf, cap, needed);
+}
+
+#elif defined __GNUC__
+
+extern char *program_invocation_name;
+
+/* canonical path of the main program, into buf of APPORTABLE_PATHBUF */
+static const char * _apportable_exe_path (char * buf)
+{
+    ssize_t l;
+    const char * execfn, * ret;
+
+    APPORTABLE_TRACE_BEGIN("readlink /proc/self/exe");
+    l = readlink("/proc/self/exe", buf, APPORTABLE_PATHBUF - 1);
+    APPORTABLE_TRACE_END("readlink /proc/self/exe");
+    if (l > 0 && l < APPORTABLE_PATHBUF - 1) {
+        buf[l] = 0;
+        return buf;
+    }
+    /* no /proc: the name it was executed by, before argv[0] */
+    APPORTABLE_TRACE_BEGIN("realpath");
+    ret = NULL;
+    if ((execfn = (const char *) getauxval(AT_EXECFN)) && realpath(execfn, buf))
+        ret = buf;
+    else if (program_invocation_name && realpath(program_invocation_name, buf))
+        ret = buf;
+    APPORTABLE_TRACE_END("realpath");
+    return ret;
+}
+
+
+struct apportable_phdr_walk
+{
+    const char * library_base_name;   /* NULL for the main program */
+    int index;
+    char * buf;
+    size_t cap;
+    size_t * needed;
+    char * ret;
+    char exe[APPORTABLE_PATHBUF];
+};
+
+static int _apportable_progfile_cb (struct dl_phdr_info * info, size_t size, void * data)
+{
+    struct apportable_phdr_walk * walk = data;
+    const char * image_name;
+    const char * library_name_sep;
+
+    (void) size;
+    image_name = info->dlpi_name;   /* absolute, but empty for the main program */
+    if (walk->index++ == 0 && (!image_name || !image_name[0]))
+        image_name = _apportable_exe_path(walk->exe);
+    if (!image_name || !image_name[0])
+        /* the main program, first, is the one asked for: not found */
+        return !walk->library_base_name;
+    library_name_sep = strrchr(image_name, DIRSEP_C);
+    if (!library_name_sep)
+        library_name_sep = image_name;
+    else
+        library_name_sep += 1;   // skip found '/'
+    if (walk->library_base_name && strcmp(library_name_sep, walk->library_base_name))
+        return 0;
+    walk->ret = _apportable_put(image_name, strlen(image_name), walk->buf, walk->cap, walk->needed);
+    return 1;
+}
+
+/* walk every loaded object, the last one included, without taking a
+ * reference on any of them */
+static char * _apportable_progfile_lookup (apportable a, const char * library_name, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+    struct apportable_phdr_walk walk;
+
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    if (!self->enabled)
+        return library_name ? _apportable_put(library_name, strlen(library_name), buf, cap, needed) : NULL;
+
+    walk.library_base_name = library_name ? strrchr(library_name, DIRSEP_C) : NULL;
+    if (!walk.library_base_name)
+        walk.library_base_name = library_name;
+    else
+        walk.library_base_name += 1;   // skip found '/'
+    walk.index = 0;
+    walk.buf = buf;
+    walk.cap = cap;
+    walk.needed = needed;
+    walk.ret = NULL;   /* stays NULL if not found or buf too small */
+    APPORTABLE_TRACE_BEGIN("dl_iterate_phdr");
+    dl_iterate_phdr(&_apportable_progfile_cb, &walk);
+    APPORTABLE_TRACE_END("dl_iterate_phdr");
+    return walk.ret;
+}
+
+
+#if defined APPORTABLE_PROGCACHE
+
+/* Results of the lookup above, per library base name, are valid for as long
+ * as the loader has not added or removed an object; dl_iterate_phdr counts
+ * both, and reading the counters off the first object is cheap. */
+
+#define APPORTABLE_PROGCACHE_MAIN "/"   /* key of the main program, no base name has a '/' */
+
+struct apportable_progcache_entry
+{
+    char * name;      /* NULL for an empty slot */
+    char * path;      /* NULL if no such object is loaded */
+    size_t path_l;
+};
+
+struct apportable_progcache
+{
+    unsigned long long adds, subs;
+    size_t count;
+    size_t mask;      /* slots - 1, a power of two less one */
+    struct apportable_progcache_entry * slots;
+};
+
+
+static int _apportable_dl_generation_cb (struct dl_phdr_info * info, size_t size, void * data)
+{
+    unsigned long long * gen = data;
+
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs)) {
+        gen[0] = info->dlpi_adds;
+        gen[1] = info->dlpi_subs;
+        gen[2] = 1;
+    }
+    return 1;   /* same counters on every object */
+}
+
+/* 0 if the loader does not tell, then nothing is cached */
+static int _apportable_dl_generation (unsigned long long * gen)
+{
+    gen[2] = 0;
+    dl_iterate_phdr(&_apportable_dl_generation_cb, gen);
+    return (int) gen[2];
+}
+
+
+static struct apportable_progcache_entry * _apportable_progcache_slot (struct apportable_progcache * cache, const char * name)
+{
+    struct apportable_progcache_entry * e;
+    size_t i;
+
+    for (i = _apportable_hash(name, strlen(name)) & cache->mask; ; i = (i + 1) & cache->mask) {
+        e = &cache->slots[i];
+        if (!e->name || !strcmp(e->name, name))
+            return e;
+    }
+}
+
+static void _apportable_progcache_clear (apportable self, struct apportable_progcache * cache)
+{
+    size_t i;
+
+    for (i = 0; i <= cache->mask; i++) {
+        if (cache->slots[i].name)
+            self->_free(cache->slots[i].name);   /* path shares the block */
+        cache->slots[i].name = NULL;
+    }
+    cache->count = 0;
+}
+
+static void _apportable_progcache_free (apportable self)
+{
+    struct apportable_progcache * cache;
+
+    if (!(cache = self->_progcache))
+        return;
+    _apportable_progcache_clear(self, cache);
+    self->_free(cache->slots);
+    self->_free(cache);
+    self->_progcache = NULL;
+}
+
+/* remember a lookup, caller holds _progcache_lock */
+static void _apportable_progcache_store (apportable self, const unsigned long long * gen, const char * name, const char * path, size_t path_l)
+{
+    struct apportable_progcache * cache;
+    struct apportable_progcache_entry * e, * old;
+    size_t name_l, i, oldmask;
+
+    if (!(cache = self->_progcache)) {
+        if (!(cache = self->_calloc(1, sizeof(*cache))))
+            return;
+        cache->mask = 15;
+        if (!(cache->slots = self->_calloc(cache->mask + 1, sizeof(*cache->slots)))) {
+            self->_free(cache);
+            return;
+        }
+        self->_progcache = cache;
+    }
+    if (cache->adds != gen[0] || cache->subs != gen[1]) {
+        _apportable_progcache_clear(self, cache);
+        cache->adds = gen[0];
+        cache->subs = gen[1];
+    }
+    if ((cache->count + 1) * 2 > cache->mask + 1) {
+        old = cache->slots;
+        oldmask = cache->mask;
+        if (!(cache->slots = self->_calloc(2 * (oldmask + 1), sizeof(*cache->slots)))) {
+            cache->slots = old;
+            return;
+        }
+        cache->mask = 2 * (oldmask + 1) - 1;
+        for (i = 0; i <= oldmask; i++)
+            if (old[i].name)
+                *_apportable_progcache_slot(cache, old[i].name) = old[i];
+        self->_free(old);
+    }
+    if ((e = _apportable_progcache_slot(cache, name))->name)
+        return;   /* another thread was quicker */
+    name_l = strlen(name);
+    if (!(e->name = self->_calloc(1, name_l + 1 + (path ? path_l + 1 : 0))))
+        return;
+    memcpy(e->name, name, name_l);
+    e->path = NULL;
+    if (path) {
+        e->path = e->name + name_l + 1;
+        memcpy(e->path, path, path_l);
+        e->path_l = path_l;
+    }
+    cache->count++;
+}
+
+
+char * apportable_progfile_into (apportable a, const char * library_name, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+    struct apportable_progcache * cache;
+    struct apportable_progcache_entry * e;
+    unsigned long long gen[3];
+    const char * name;
+    char path[APPORTABLE_PATHBUF];
+    char * ret;
+    size_t path_l;
+    int hit;
+
+    self = APPORTABLE_STATE(a);
+    if (!library_name && self->enabled && _apportable_exe_get())
+        return _apportable_put(_apportable_exe.path, _apportable_exe.path_l, buf, cap, needed);
+    if (!self->enabled || !_apportable_dl_generation(gen))
+        return _apportable_progfile_lookup(self, library_name, buf, cap, needed);
+
+    name = library_name ? strrchr(library_name, DIRSEP_C) : NULL;
+    name = name ? name + 1 : library_name ? library_name : APPORTABLE_PROGCACHE_MAIN;
+
+    ret = NULL;
+    hit = 0;
+    apportable_lock(&self->_progcache_lock);
+    if ((cache = self->_progcache) && cache->adds == gen[0] && cache->subs == gen[1]
+            && (e = _apportable_progcache_slot(cache, name))->name) {
+        hit = 1;
+        if (e->path)
+            ret = _apportable_put(e->path, e->path_l, buf, cap, needed);
+        else if (needed)
+            *needed = 0;
+    }
+    apportable_unlock(&self->_progcache_lock);
+    if (hit)
+        return ret;
+
+    if (!_apportable_progfile_lookup(self, library_name, path, sizeof(path), &path_l) && path_l)
+        return _apportable_progfile_lookup(self, library_name, buf, cap, needed);   /* too long to keep */
+    apportable_lock(&self->_progcache_lock);
+    _apportable_progcache_store(self, gen, name, path_l ? path : NULL, path_l ? path_l - 1 : 0);
+    apportable_unlock(&self->_progcache_lock);
+    if (!path_l) {
+        if (needed)
+            *needed = 0;
+        return NULL;
+    }
+    return _apportable_put(path, path_l - 1, buf, cap, needed);
+}
+
+#else
+
+char * apportable_progfile_into (apportable a, const char * library_name, char * buf, size_t cap, size_t * needed)
+{
+    return _apportable_progfile_lookup(a, library_name, buf, cap, needed);
+}
+
+#endif /*APPORTABLE_PROGCACHE*/
+
+
+/* progfile_for_address: the object one of whose loaded segments holds
+ * addr.  While the loader generation holds still, the PT_LOAD segments of
+ * all objects are kept sorted by address and searched by bisection;
+ * otherwise every object is walked. */
+
+struct apportable_addr_walk
+{
+    uintptr_t addr;
+    int index;
+    const char * path;    /* of the object found, NULL until then */
+};
+
+/* the name of an object, the program's own from the snapshot */
+static const char * _apportable_phdr_name (struct dl_phdr_info * info, int index)
+{
+    const struct apportable_exe * exe;
+
+    if (index == 0 && (!info->dlpi_name || !info->dlpi_name[0]))
+        return (exe = _apportable_exe_get()) ? exe->path : NULL;
+    return info->dlpi_name && info->dlpi_name[0] ? info->dlpi_name : NULL;
+}
+
+static int _apportable_addr_cb (struct dl_phdr_info * info, size_t size, void * data)
+{
+    struct apportable_addr_walk * walk = data;
+    uintptr_t lo;
+    int i;
+
+    (void) size;
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        if (info->dlpi_phdr[i].p_type != PT_LOAD)
+            continue;
+        lo = (uintptr_t) info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+        if (walk->addr >= lo && walk->addr - lo < info->dlpi_phdr[i].p_memsz) {
+            walk->path = _apportable_phdr_name(info, walk->index);
+            return 1;
+        }
+    }
+    walk->index++;
+    return 0;
+}
+
+#if defined APPORTABLE_PROGCACHE
+
+struct apportable_segment
+{
+    uintptr_t lo, hi;     /* [lo, hi) */
+    const char * path;    /* NULL for an object without a name */
+    size_t path_l;
+};
+
+struct apportable_segindex
+{
+    unsigned long long adds, subs;
+    size_t count;
+    struct apportable_segment seg[1];   /* count of them, then the paths */
+};
+
+struct apportable_segindex_walk
+{
+    struct apportable_segindex * index;   /* NULL while measuring */
+    size_t count, text_l;                 /* so far */
+    size_t max_count, max_text_l;         /* room in index */
+    char * text;
+    int object;
+};
+
+static int _apportable_segindex_cb (struct dl_phdr_info * info, size_t size, void * data)
+{
+    struct apportable_segindex_walk * walk = data;
+    struct apportable_segment * seg;
+    const char * path;
+    size_t path_l;
+    int i;
+
+    (void) size;
+    path = _apportable_phdr_name(info, walk->object++);
+    path_l = path ? strlen(path) : 0;
+    if (walk->index && path && walk->text_l + path_l + 1 <= walk->max_text_l)
+        memcpy(walk->text + walk->text_l, path, path_l + 1);
+    else if (walk->index)
+        path = NULL;   /* loaded since it was measured */
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        if (info->dlpi_phdr[i].p_type != PT_LOAD || !info->dlpi_phdr[i].p_memsz)
+            continue;
+        if (walk->index && walk->count < walk->max_count) {
+            seg = &walk->index->seg[walk->count];
+            seg->lo = (uintptr_t) info->dlpi_addr + info->dlpi_phdr[i].p_vaddr;
+            seg->hi = seg->lo + info->dlpi_phdr[i].p_memsz;
+            seg->path = path ? walk->text + walk->text_l : NULL;
+            seg->path_l = path_l;
+        }
+        walk->count++;
+    }
+    walk->text_l += path ? path_l + 1 : 0;
+    return 0;
+}
+
+static int _apportable_segment_cmp (const void * a, const void * b)
+{
+    const struct apportable_segment * sa = a, * sb = b;
+
+    return sa->lo < sb->lo ? -1 : sa->lo > sb->lo;
+}
+
+static void _apportable_segindex_free (apportable self)
+{
+    self->_free(self->_segindex);
+    self->_segindex = NULL;
+}
+
+/* a new index, for generation gen; the loader is not called under our lock */
+static struct apportable_segindex * _apportable_segindex_build (apportable self, const unsigned long long * gen)
+{
+    struct apportable_segindex * index;
+    struct apportable_segindex_walk walk;
+
+    memset(&walk, 0, sizeof(walk));
+    dl_iterate_phdr(&_apportable_segindex_cb, &walk);
+    walk.max_count = walk.count;
+    walk.max_text_l = walk.text_l;
+    index = self->_calloc(1, sizeof(*index) + walk.max_count * sizeof(*index->seg) + walk.max_text_l);
+    if (!index)
+        return NULL;
+    walk.index = index;
+    walk.text = (char *) &index->seg[walk.max_count ? walk.max_count : 1];
+    walk.count = walk.text_l = 0;
+    walk.object = 0;
+    dl_iterate_phdr(&_apportable_segindex_cb, &walk);
+    index->count = walk.count < walk.max_count ? walk.count : walk.max_count;
+    qsort(index->seg, index->count, sizeof(*index->seg), &_apportable_segment_cmp);
+    /* objects that came or went meanwhile are seen at the next call */
+    index->adds = gen[0];
+    index->subs = gen[1];
+    return index;
+}
+
+#endif /*APPORTABLE_PROGCACHE*/
+
+char * apportable_progfile_for_address_into (apportable a, const void * addr, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
+    struct apportable_addr_walk walk;
+#if defined APPORTABLE_PROGCACHE
+    struct apportable_segindex * index;
+    const struct apportable_segment * seg;
+    unsigned long long gen[3];
+    size_t lo, hi, mid;
+    char * ret;
+#endif
+
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    if (!self->enabled || !addr)
+        return NULL;
+
+#if defined APPORTABLE_PROGCACHE
+    if (_apportable_dl_generation(gen)) {
+        ret = NULL;
+        apportable_lock(&self->_segindex_lock);
+        if (!(index = self->_segindex) || index->adds != gen[0] || index->subs != gen[1]) {
+            apportable_unlock(&self->_segindex_lock);
+            APPORTABLE_TRACE_BEGIN("segindex");
+            index = _apportable_segindex_build(self, gen);
+            APPORTABLE_TRACE_END("segindex");
+            apportable_lock(&self->_segindex_lock);
+            if (index) {
+                _apportable_segindex_free(self);   /* stale, or as new as ours */
+                self->_segindex = index;
+            }
+        }
+        if (index) {
+            /* the last segment starting at or below addr */
+            for (lo = 0, hi = index->count; lo < hi; ) {
+                mid = lo + (hi - lo) / 2;
+                if (index->seg[mid].lo <= (uintptr_t) addr)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            seg = lo ? &index->seg[lo - 1] : NULL;
+            if (seg && (uintptr_t) addr < seg->hi && seg->path)
+                ret = _apportable_put(seg->path, seg->path_l, buf, cap, needed);
+        }
+        apportable_unlock(&self->_segindex_lock);
+        if (index)
+            return ret;
+    }
+#endif
+    walk.addr = (uintptr_t) addr;
+    walk.index = 0;
+    walk.path = NULL;
+    APPORTABLE_TRACE_BEGIN("dl_iterate_phdr");
+    dl_iterate_phdr(&_apportable_addr_cb, &walk);
+    APPORTABLE_TRACE_END("dl_iterate_phdr");
+    return walk.path ? _apportable_put(walk.path, strlen(walk.path), buf, cap, needed) : NULL;
+}
+
+
+// #else
+
+// char * apportable_progfile (apportable a, const wchar_t * library_name) {
+// 	return NULL;
+// }
+
+// char * apportable_pathexp(apportable a, const wchar_t * template, const wchar_t * library_path) {
+// 	return self->_strndup(a, template, strlen(template));
+// }
+
+#endif /*_WIN32, __APPLE__, ...*/
+
+
+#if !defined _WIN32
+char * apportable_progfile (apportable a, const char * library_name)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    APPORTABLE_INTO_ALLOC(self, progfile_into, library_name);
+}
+#endif
+
+char * apportable_progfile_for_address (apportable a, const void * addr)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    APPORTABLE_INTO_ALLOC(self, progfile_for_address_into, addr);
+}
+
+static char * _apportable_progfile_sv_into (apportable self, const char * library_name, char * buf, size_t cap, size_t * needed)
+{
+    return self->progfile_into(self, library_name, buf, cap, needed);
+}
+
+apportable_sv apportable_progfile_sv (apportable a, apportable_sv library_name)
+{
+    apportable self;
+    apportable_sv none = {NULL, 0};
+    char name[APPORTABLE_PATHBUF];
+
+    self = APPORTABLE_STATE(a);
+    if (!self->enabled)
+        return none;
+    if (!library_name.p)
+        APPORTABLE_INTO_ALLOC_SV(self, _apportable_progfile_sv_into, (const char *) NULL);
+    /* no loaded object has a name this long, or holding a NUL */
+    if (library_name.n >= sizeof(name) || memchr(library_name.p, 0, library_name.n))
+        return none;
+    memcpy(name, library_name.p, library_name.n);
+    name[library_name.n] = 0;
+    APPORTABLE_INTO_ALLOC_SV(self, _apportable_progfile_sv_into, (const char *) name);
+}
+
+
+/* canonical path of the program into buf of APPORTABLE_PATHBUF, its
+ * length or 0 */
+static size_t _apportable_exe_resolve (char * buf)
+{
+#if defined _WIN32
+    wchar_t wbuf[MAX_PATH];
+    DWORD l;
+
+    if (!(l = GetModuleFileNameW(NULL, wbuf, MAX_PATH)) || l >= MAX_PATH)
+        return 0;
+    if (!(l = WideCharToMultiByte(CP_UTF8, 0, wbuf, l + 1, buf, APPORTABLE_PATHBUF, NULL, NULL)))
+        return 0;
+    return l - 1;
+#elif defined __APPLE__
+    char raw[APPORTABLE_PATHBUF];
+    uint32_t size;
+
+    size = sizeof(raw);
+    if (_NSGetExecutablePath(raw, &size) != 0 || !realpath(raw, buf))
+        return 0;
+    return strlen(buf);
+#elif defined __linux__
+    return _apportable_exe_path(buf) ? strlen(buf) : 0;
+#else
+    (void) buf;
+    return 0;
+#endif
+}
+
+static const struct apportable_exe * _apportable_exe_get (void)
+{
+    struct apportable_exe * exe = &_apportable_exe;
+    const char * sep;
+
+    if (apportable_load_int(&exe->state) != 1) {
+        if (!apportable_cas_int(&exe->state, 0, -1)) {
+            while (apportable_load_int(&exe->state) != 1)
+                apportable_yield();
+        } else {
+            APPORTABLE_TRACE_BEGIN("exe_resolve");
+            exe->path_l = _apportable_exe_resolve(exe->buf);
+            APPORTABLE_TRACE_END("exe_resolve");
+            if (exe->path_l) {
+                exe->path = exe->buf;
+                /* the directory, kept as is for a program in the root */
+                sep = strrchr(exe->path, DIRSEP_C);
+                exe->origin_l = !sep ? 1 : sep == exe->path ? 1 : (size_t) (sep - exe->path);
+                exe->origin = exe->buf + exe->path_l + 1;
+                memcpy(exe->buf + exe->path_l + 1, sep ? exe->path : ".", exe->origin_l);
+            }
+            apportable_store_int(&exe->state, 1);
+        }
+    }
+    return exe->path ? exe : NULL;
+}
+
+#if defined APPORTABLE_CONSTRUCTOR && defined __GNUC__
+__attribute__((constructor))
+static void _apportable_exe_constructor (void)
+{
+    _apportable_exe_get();
+}
+#endif
+
+const char * apportable_exepath (apportable a, size_t * len)
+{
+    apportable self;
+    const struct apportable_exe * exe;
+
+    self = APPORTABLE_STATE(a);
+    if (!self->enabled || !(exe = _apportable_exe_get())) {
+        if (len)
+            *len = 0;
+        return NULL;
+    }
+    if (len)
+        *len = exe->path_l;
+    return exe->path;
+}
+
+const char * apportable_origin (apportable a, size_t * len)
+{
+    apportable self;
+    const struct apportable_exe * exe;
+
+    self = APPORTABLE_STATE(a);
+    if (!self->enabled || !(exe = _apportable_exe_get())) {
+        if (len)
+            *len = 0;
+        return NULL;
+    }
+    if (len)
+        *len = exe->origin_l;
+    return exe->origin;
+}
+
+
+/* Installation directories relocated to the program: the prefix is the
+ * directory of the program, less a last component of bin, sbin, lib,
+ * lib64 or libexec, and the others lie below it where configure puts
+ * them by default.  Each can be changed at build time. */
+
+#if !defined APPORTABLE_BINDIR
+# define APPORTABLE_BINDIR "bin"
+#endif
+#if !defined APPORTABLE_SBINDIR
+# define APPORTABLE_SBINDIR "sbin"
+#endif
+#if !defined APPORTABLE_LIBEXECDIR
+# define APPORTABLE_LIBEXECDIR "libexec"
+#endif
+#if !defined APPORTABLE_SYSCONFDIR
+# define APPORTABLE_SYSCONFDIR "etc"
+#endif
+#if !defined APPORTABLE_SHAREDSTATEDIR
+# define APPORTABLE_SHAREDSTATEDIR "com"
+#endif
+#if !defined APPORTABLE_LOCALSTATEDIR
+# define APPORTABLE_LOCALSTATEDIR "var"
+#endif
+#if !defined APPORTABLE_RUNSTATEDIR
+# define APPORTABLE_RUNSTATEDIR "var" DIRSEP_S "run"
+#endif
+#if !defined APPORTABLE_LIBDIR
+# define APPORTABLE_LIBDIR "lib"
+#endif
+#if !defined APPORTABLE_INCLUDEDIR
+# define APPORTABLE_INCLUDEDIR "include"
+#endif
+#if !defined APPORTABLE_DATAROOTDIR
+# define APPORTABLE_DATAROOTDIR "share"
+#endif
+#if !defined APPORTABLE_DATADIR
+# define APPORTABLE_DATADIR APPORTABLE_DATAROOTDIR
+#endif
+#if !defined APPORTABLE_LOCALEDIR
+# define APPORTABLE_LOCALEDIR APPORTABLE_DATAROOTDIR DIRSEP_S "locale"
+#endif
+#if !defined APPORTABLE_MANDIR
+# define APPORTABLE_MANDIR APPORTABLE_DATAROOTDIR DIRSEP_S "man"
+#endif
+#if !defined APPORTABLE_DOCDIR
+# define APPORTABLE_DOCDIR APPORTABLE_DATAROOTDIR DIRSEP_S "doc"
+#endif
+
+static const struct
+{
+    size_t field;
+    const char * rel;
+} _apportable_dirs_rel[] = {
+    {offsetof(struct apportable_dirs, bindir), APPORTABLE_BINDIR},
+    {offsetof(struct apportable_dirs, sbindir), APPORTABLE_SBINDIR},
+    {offsetof(struct apportable_dirs, libexecdir), APPORTABLE_LIBEXECDIR},
+    {offsetof(struct apportable_dirs, sysconfdir), APPORTABLE_SYSCONFDIR},
+    {offsetof(struct apportable_dirs, sharedstatedir), APPORTABLE_SHAREDSTATEDIR},
+    {offsetof(struct apportable_dirs, localstatedir), APPORTABLE_LOCALSTATEDIR},
+    {offsetof(struct apportable_dirs, runstatedir), APPORTABLE_RUNSTATEDIR},
+    {offsetof(struct apportable_dirs, libdir), APPORTABLE_LIBDIR},
+    {offsetof(struct apportable_dirs, includedir), APPORTABLE_INCLUDEDIR},
+    {offsetof(struct apportable_dirs, datarootdir), APPORTABLE_DATAROOTDIR},
+    {offsetof(struct apportable_dirs, datadir), APPORTABLE_DATADIR},
+    {offsetof(struct apportable_dirs, localedir), APPORTABLE_LOCALEDIR},
+    {offsetof(struct apportable_dirs, mandir), APPORTABLE_MANDIR},
+    {offsetof(struct apportable_dirs, docdir), APPORTABLE_DOCDIR},
+};
+
+#define APPORTABLE_DIRS_N (sizeof(_apportable_dirs_rel) / sizeof(*_apportable_dirs_rel))
+
+
+/* the table with its strings in one block, from the snapshot */
+static struct apportable_dirs * _apportable_dirs_build (apportable self, const struct apportable_exe * exe)
+{
+    static const char * const strip[] = {"bin", "sbin", "lib", "lib64", "libexec"};
+    struct apportable_dirs * dirs;
+    apportable_sv * sv;
+    const char * base;
+    size_t prefix_l, base_l, size, rel_l, i;
+    char * p;
+    int sep;
+
+    /* the prefix, the root kept as such */
+    prefix_l = exe->origin_l;
+    for (base = exe->origin + prefix_l; base > exe->origin && base[-1] != DIRSEP_C; base--)
+        ;
+    base_l = exe->origin + prefix_l - base;
+    for (i = 0; base > exe->origin && i < sizeof(strip) / sizeof(*strip); i++)
+        if (strlen(strip[i]) == base_l && !strncmp(base, strip[i], base_l)) {
+            prefix_l = base - 1 > exe->origin ? (size_t) (base - 1 - exe->origin) : 1;
+            break;
+        }
+    sep = exe->origin[prefix_l - 1] != DIRSEP_C;
+
+    size = sizeof(*dirs) + prefix_l + 1;
+    for (i = 0; i < APPORTABLE_DIRS_N; i++)
+        size += prefix_l + sep + strlen(_apportable_dirs_rel[i].rel) + 1;
+    if (!(dirs = self->_calloc(1, size)))
+        return NULL;
+    p = (char *) (dirs + 1);
+    memcpy(p, exe->origin, prefix_l);
+    dirs->prefix.p = dirs->exec_prefix.p = p;
+    dirs->prefix.n = dirs->exec_prefix.n = prefix_l;
+    p += prefix_l + 1;
+    for (i = 0; i < APPORTABLE_DIRS_N; i++) {
+        sv = (apportable_sv *) ((char *) dirs + _apportable_dirs_rel[i].field);
+        rel_l = strlen(_apportable_dirs_rel[i].rel);
+        sv->p = p;
+        sv->n = prefix_l + sep + rel_l;
+        memcpy(p, exe->origin, prefix_l);
+        if (sep)
+            p[prefix_l] = DIRSEP_C;
+        memcpy(p + prefix_l + sep, _apportable_dirs_rel[i].rel, rel_l);
+        p += sv->n + 1;
+    }
+    return dirs;
+}
+
+static void _apportable_dirs_free (apportable self)
+{
+    self->_free((void *) self->_dirs);
+    self->_dirs = NULL;
+}
+
+const struct apportable_dirs * apportable_dirs (apportable a)
+{
+    apportable self;
+    const struct apportable_exe * exe;
+    struct apportable_dirs * dirs;
+
+    self = APPORTABLE_STATE(a);
+    if ((dirs = apportable_load_ptr(&self->_dirs)))
+        return dirs;
+    if (!self->enabled || !(exe = _apportable_exe_get()))
+        return NULL;
+    apportable_lock(&self->_dirs_lock);
+    if (!(dirs = self->_dirs) && (dirs = _apportable_dirs_build(self, exe)))
+        apportable_store_ptr(&self->_dirs, dirs);
+    apportable_unlock(&self->_dirs_lock);
+    return dirs;
+}
+
+
+
+#if defined APPORTABLE_PATHINDEX
+
+/* With APPORTABLE_WHEREIS_INDEX, an absolute search path directory is read
+ * once into a set of names, and whereis only asks access() about a name the
+ * set has.  A listing is used as is for APPORTABLE_PATHINDEX_TTL ms, after
+ * that for as long as the directory's identity and mtime stay the same.
+ * A listing taken within the mtime granularity of a change could miss a
+ * file created right after it: such a "racy" listing answers no misses and
+ * is read again at the next check. */
+
+#if defined __APPLE__
+# define APPORTABLE_ST_MTIM(st) ((st).st_mtimespec)
+#else
+# define APPORTABLE_ST_MTIM(st) ((st).st_mtim)
+#endif
+
+#define APPORTABLE_PATHDIR_MISSING 0   /* could not stat, nothing in there */
+#define APPORTABLE_PATHDIR_OPAQUE 1    /* could not list, ask access() */
+#define APPORTABLE_PATHDIR_LISTED 2
+
+struct apportable_pathdir
+{
+    const char * path;    /* as spelled in the search path, "" for the root */
+    size_t path_l;
+    int state;
+    int racy;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime_s;
+    long mtime_ns;
+    long long checked;    /* CLOCK_MONOTONIC, ms */
+    size_t mask;
+    const char ** names;  /* mask + 1 slots; slots, path and names share the block */
+};
+
+struct apportable_pathindex
+{
+    size_t count;
+    size_t mask;
+    struct apportable_pathdir ** slots;
+};
+
+
+static long long _apportable_now_ms (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int _apportable_pathdir_same (const struct apportable_pathdir * dir, int found, const struct stat * st)
+{
+    if (dir->state == APPORTABLE_PATHDIR_MISSING)
+        return !found;
+    return found && !dir->racy && dir->dev == st->st_dev && dir->ino == st->st_ino
+        && dir->mtime_s == APPORTABLE_ST_MTIM(*st).tv_sec
+        && dir->mtime_ns == APPORTABLE_ST_MTIM(*st).tv_nsec;
+}
+
+/* 1 if dir has bin, 0 if it has not, -1 if it cannot tell */
+static int _apportable_pathdir_has (const struct apportable_pathdir * dir, const char * bin, size_t bin_l)
+{
+    size_t i;
+
+    if (dir->state != APPORTABLE_PATHDIR_LISTED)
+        return dir->state == APPORTABLE_PATHDIR_MISSING ? 0 : -1;
+    for (i = _apportable_hash(bin, bin_l) & dir->mask; dir->names[i]; i = (i + 1) & dir->mask)
+        if (!strcmp(dir->names[i], bin))
+            return 1;
+    return dir->racy ? -1 : 0;
+}
+
+/* read dirname into a new listing, NULL if out of memory */
+static struct apportable_pathdir * _apportable_pathdir_scan (apportable self, const char * path, size_t path_l,
+        const char * dirname, int found, const struct stat * st)
+{
+    struct apportable_pathdir * dir;
+    DIR * d;
+    struct dirent * de;
+    char * names, * grown, * p;
+    size_t names_l, names_cap, name_l, count, mask, i;
+    time_t started;
+    int state;
+
+    names = NULL;
+    names_l = names_cap = count = 0;
+    state = APPORTABLE_PATHDIR_MISSING;
+    started = time(NULL);
+    if (found) {
+        state = APPORTABLE_PATHDIR_OPAQUE;
+        APPORTABLE_TRACE_BEGIN("opendir");
+        d = opendir(dirname);
+        APPORTABLE_TRACE_END("opendir");
+        if (d) {
+            state = APPORTABLE_PATHDIR_LISTED;
+            while ((de = readdir(d))) {
+                name_l = strlen(de->d_name) + 1;
+                if (names_l + name_l > names_cap) {
+                    names_cap = names_cap ? 2 * names_cap : 4096;
+                    if (names_cap < names_l + name_l)
+                        names_cap = names_l + name_l;
+                    if (!(grown = self->_calloc(1, names_cap))) {
+                        state = APPORTABLE_PATHDIR_OPAQUE;
+                        break;
+                    }
+                    if (names)
+                        memcpy(grown, names, names_l);
+                    self->_free(names);
+                    names = grown;
+                }
+                memcpy(names + names_l, de->d_name, name_l);
+                names_l += name_l;
+                count++;
+            }
+            closedir(d);
+        }
+    }
+    if (state != APPORTABLE_PATHDIR_LISTED)
+        names_l = count = 0;
+
+    for (mask = 7; mask + 1 < 2 * count; mask = 2 * mask + 1)
+        ;
+    dir = self->_calloc(1, sizeof(*dir) + (mask + 1) * sizeof(*dir->names) + path_l + 1 + names_l);
+    if (dir) {
+        dir->names = (const char **) (dir + 1);
+        p = (char *) (dir->names + mask + 1);
+        memcpy(p, path, path_l);
+        dir->path = p;
+        dir->path_l = path_l;
+        p += path_l + 1;
+        if (names_l)
+            memcpy(p, names, names_l);
+        dir->mask = mask;
+        for (; count; count--) {
+            name_l = strlen(p);
+            for (i = _apportable_hash(p, name_l) & mask; dir->names[i]; i = (i + 1) & mask)
+                ;
+            dir->names[i] = p;
+            p += name_l + 1;
+        }
+        dir->state = state;
+        if (found) {
+            dir->dev = st->st_dev;
+            dir->ino = st->st_ino;
+            dir->mtime_s = APPORTABLE_ST_MTIM(*st).tv_sec;
+            dir->mtime_ns = APPORTABLE_ST_MTIM(*st).tv_nsec;
+            dir->racy = dir->mtime_s >= started;
+        }
+    }
+    self->_free(names);
+    return dir;
+}
+
+/* slot of the listing for path, caller holds _pathindex_lock */
+static struct apportable_pathdir ** _apportable_pathindex_slot (struct apportable_pathindex * index, const char * path, size_t path_l)
+{
+    struct apportable_pathdir ** e;
+    size_t i;
+
+    for (i = _apportable_hash(path, path_l) & index->mask; ; i = (i + 1) & index->mask) {
+        e = &index->slots[i];
+        if (!*e || ((*e)->path_l == path_l && !memcmp((*e)->path, path, path_l)))
+            return e;
+    }
+}
+
+static void _apportable_pathindex_free (apportable self)
+{
+    struct apportable_pathindex * index;
+    size_t i;
+
+    if (!(index = self->_pathindex))
+        return;
+    for (i = 0; i <= index->mask; i++)
+        self->_free(index->slots[i]);
+    self->_free(index->slots);
+    self->_free(index);
+    self->_pathindex = NULL;
+}
+
+/* take over dir in place of any listing of the same path, caller holds
+ * _pathindex_lock; dir is freed if it cannot be kept */
+static struct apportable_pathdir * _apportable_pathindex_store (apportable self, struct apportable_pathdir * dir)
+{
+    struct apportable_pathindex * index;
+    struct apportable_pathdir ** e, ** old;
+    size_t i, oldmask;
+
+    if (!(index = self->_pathindex)) {
+        if (!(index = self->_calloc(1, sizeof(*index))))
+            goto fail;
+        index->mask = 15;
+        if (!(index->slots = self->_calloc(index->mask + 1, sizeof(*index->slots)))) {
+            self->_free(index);
+            goto fail;
+        }
+        self->_pathindex = index;
+    }
+    if ((index->count + 1) * 2 > index->mask + 1) {
+        old = index->slots;
+        oldmask = index->mask;
+        if (!(index->slots = self->_calloc(2 * (oldmask + 1), sizeof(*index->slots)))) {
+            index->slots = old;
+            goto fail;
+        }
+        index->mask = 2 * (oldmask + 1) - 1;
+        for (i = 0; i <= oldmask; i++)
+            if (old[i])
+                *_apportable_pathindex_slot(index, old[i]->path, old[i]->path_l) = old[i];
+        self->_free(old);
+    }
+    e = _apportable_pathindex_slot(index, dir->path, dir->path_l);
+    if (*e)
+        self->_free(*e);
+    else
+        index->count++;
+    *e = dir;
+    return dir;
+fail:
+    self->_free(dir);
+    return NULL;
+}
+
+/* whether the search path directory path (path_l bytes, "" for the root)
+ * has bin: 1 if it has, 0 if it has not, -1 if it cannot tell */
+static int _apportable_pathindex_has (apportable self, const char * path, size_t path_l, const char * bin, size_t bin_l)
+{
+    struct apportable_pathdir ** e, * dir;
+    char dirname[APPORTABLE_PATHBUF];
+    struct stat st;
+    long long now;
+    int found, ret;
+
+    if (path_l >= sizeof(dirname))
+        return -1;
+    now = _apportable_now_ms();
+    apportable_lock(&self->_pathindex_lock);
+    ret = -2;
+    if (self->_pathindex && (dir = *_apportable_pathindex_slot(self->_pathindex, path, path_l))
+            && now - dir->checked < APPORTABLE_PATHINDEX_TTL)
+        ret = _apportable_pathdir_has(dir, bin, bin_l);
+    apportable_unlock(&self->_pathindex_lock);
+    if (ret != -2)
+        return ret;
+
+    memcpy(dirname, path, path_l);
+    dirname[path_l] = 0;
+    found = stat(path_l ? dirname : DIRSEP_S, &st) == 0 && S_ISDIR(st.st_mode);
+
+    apportable_lock(&self->_pathindex_lock);
+    if (self->_pathindex && *(e = _apportable_pathindex_slot(self->_pathindex, path, path_l))
+            && _apportable_pathdir_same(*e, found, &st)) {
+        (*e)->checked = now;
+        ret = _apportable_pathdir_has(*e, bin, bin_l);
+    }
+    apportable_unlock(&self->_pathindex_lock);
+    if (ret != -2)
+        return ret;
+
+    if (!(dir = _apportable_pathdir_scan(self, path, path_l, path_l ? dirname : DIRSEP_S, found, &st)))
+        return -1;
+    dir->checked = now;
+    ret = -1;
+    apportable_lock(&self->_pathindex_lock);
+    if ((dir = _apportable_pathindex_store(self, dir)))
+        ret = _apportable_pathdir_has(dir, bin, bin_l);
+    apportable_unlock(&self->_pathindex_lock);
+    return ret;
+}
+
+/* With APPORTABLE_WHEREIS_DIRFD, absolute search path directories are kept
+ * open and probed with faccessat(), so no path is walked from the root for
+ * each candidate.  Up to APPORTABLE_DIRFD_MAX are held; after
+ * APPORTABLE_PATHINDEX_TTL ms an entry is checked against a stat() of its
+ * path, and reopened if the directory was replaced. */
+
+#if defined O_PATH
+# define APPORTABLE_DIRFD_OPEN (O_PATH | O_DIRECTORY | O_CLOEXEC)
+#else
+# define APPORTABLE_DIRFD_OPEN (O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+#endif
+#define APPORTABLE_DIRFD_MAX 64
+
+struct apportable_dirfd
+{
+    char * path;          /* shares the block */
+    size_t path_l;
+    int fd;               /* -1 if there is no such directory */
+    int refs;             /* probes running on fd */
+    int orphan;           /* no longer in the table, closed by the last probe */
+    dev_t dev;
+    ino_t ino;
+    long long checked;    /* CLOCK_MONOTONIC, ms */
+};
+
+struct apportable_dirfds
+{
+    size_t count;
+    struct apportable_dirfd * e[APPORTABLE_DIRFD_MAX];
+};
+
+
+/* caller holds _dirfds_lock */
+static size_t _apportable_dirfds_find (struct apportable_dirfds * fds, const char * path, size_t path_l)
+{
+    size_t i;
+
+    for (i = 0; fds && i < fds->count; i++)
+        if (fds->e[i]->path_l == path_l && !memcmp(fds->e[i]->path, path, path_l))
+            return i;
+    return (size_t) -1;
+}
+
+/* take entry i out of the table, caller holds _dirfds_lock */
+static void _apportable_dirfds_drop (apportable self, size_t i)
+{
+    struct apportable_dirfds * fds = self->_dirfds;
+    struct apportable_dirfd * e = fds->e[i];
+
+    fds->e[i] = fds->e[--fds->count];
+    if (e->refs) {
+        e->orphan = 1;
+        return;
+    }
+    if (e->fd >= 0)
+        close(e->fd);
+    self->_free(e);
+}
+
+static void _apportable_dirfds_free (apportable self)
+{
+    if (!self->_dirfds)
+        return;
+    while (self->_dirfds->count)
+        _apportable_dirfds_drop(self, 0);
+    self->_free(self->_dirfds);
+    self->_dirfds = NULL;
+}
+
+/* hold an entry for path, opening the directory if needed; NULL if it
+ * cannot be opened */
+static struct apportable_dirfd * _apportable_dirfd_get (apportable self, const char * path, size_t path_l, const char * dirname)
+{
+    struct apportable_dirfds * fds;
+    struct apportable_dirfd * e;
+    struct stat st;
+    long long now;
+    size_t i, oldest;
+    int fd, found;
+
+    now = _apportable_now_ms();
+    apportable_lock(&self->_dirfds_lock);
+    if ((i = _apportable_dirfds_find(self->_dirfds, path, path_l)) != (size_t) -1
+            && now - (e = self->_dirfds->e[i])->checked < APPORTABLE_PATHINDEX_TTL) {
+        e->refs++;
+        apportable_unlock(&self->_dirfds_lock);
+        return e;
+    }
+    apportable_unlock(&self->_dirfds_lock);
+
+    found = stat(dirname, &st) == 0;
+    apportable_lock(&self->_dirfds_lock);
+    if ((i = _apportable_dirfds_find(self->_dirfds, path, path_l)) != (size_t) -1) {
+        e = self->_dirfds->e[i];
+        if (found ? e->fd >= 0 && e->dev == st.st_dev && e->ino == st.st_ino : e->fd < 0) {
+            e->checked = now;
+            e->refs++;
+            apportable_unlock(&self->_dirfds_lock);
+            return e;
+        }
+        _apportable_dirfds_drop(self, i);
+    }
+    apportable_unlock(&self->_dirfds_lock);
+
+    fd = -1;   /* a missing directory is remembered as such */
+    if (found && ((fd = open(dirname, APPORTABLE_DIRFD_OPEN)) < 0 || fstat(fd, &st) != 0)) {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    if (!(e = self->_calloc(1, sizeof(*e) + path_l + 1))) {
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    e->path = (char *) (e + 1);
+    memcpy(e->path, path, path_l);
+    e->path_l = path_l;
+    e->fd = fd;
+    e->refs = 1;
+    if (found) {
+        e->dev = st.st_dev;
+        e->ino = st.st_ino;
+    }
+    e->checked = now;
+
+    apportable_lock(&self->_dirfds_lock);
+    if (!(fds = self->_dirfds))
+        fds = self->_dirfds = self->_calloc(1, sizeof(*fds));
+    if (fds && (i = _apportable_dirfds_find(fds, path, path_l)) != (size_t) -1)
+        _apportable_dirfds_drop(self, i);   /* another thread was quicker */
+    if (fds && fds->count == APPORTABLE_DIRFD_MAX) {
+        for (i = 0, oldest = (size_t) -1; i < fds->count; i++)
+            if (!fds->e[i]->refs && (oldest == (size_t) -1 || fds->e[i]->checked < fds->e[oldest]->checked))
+                oldest = i;
+        if (oldest != (size_t) -1)
+            _apportable_dirfds_drop(self, oldest);
+    }
+    if (fds && fds->count < APPORTABLE_DIRFD_MAX)
+        fds->e[fds->count++] = e;
+    else
+        e->orphan = 1;   /* full of busy entries, use it once */
+    apportable_unlock(&self->_dirfds_lock);
+    return e;
+}
+
+static void _apportable_dirfd_put (apportable self, struct apportable_dirfd * e)
+{
+    apportable_lock(&self->_dirfds_lock);
+    if (!--e->refs && e->orphan) {
+        if (e->fd >= 0)
+            close(e->fd);
+        self->_free(e);
+    }
+    apportable_unlock(&self->_dirfds_lock);
+}
+
+/* access() for bin in the search path directory path (path_l bytes, ""
+ * for the root): 0 if accessible, 1 if not, -1 to ask access() */
+static int _apportable_dirfd_access (apportable self, const char * path, size_t path_l, const char * bin, int mode)
+{
+    struct apportable_dirfd * e;
+    char dirname[APPORTABLE_PATHBUF];
+    int ret;
+
+    if (path_l >= sizeof(dirname))
+        return -1;
+    memcpy(dirname, path, path_l);
+    dirname[path_l] = 0;
+    if (!(e = _apportable_dirfd_get(self, path, path_l, path_l ? dirname : DIRSEP_S)))
+        return -1;
+    APPORTABLE_TRACE_BEGIN("faccessat");
+    ret = e->fd >= 0 && faccessat(e->fd, bin, mode, 0) == 0 ? 0 : 1;
+    APPORTABLE_TRACE_END("faccessat");
+    _apportable_dirfd_put(self, e);
+    return ret;
+}
+
+#endif /*APPORTABLE_PATHINDEX*/
+
+#if defined APPORTABLE_URING
+
+/* With APPORTABLE_WHEREIS_URING, whereis sends the statx() of every
+ * candidate to the kernel at once, up to APPORTABLE_URING_BATCH at a time,
+ * and waits for all of them; on a slow filesystem the probes then overlap
+ * instead of adding up.  The first candidate in search path order that
+ * exists is confirmed with access().  The ring is set up on first use and
+ * kept; if that fails (no io_uring, or blocked by seccomp or sysctl)
+ * whereis probes one by one, as it does while another thread holds it. */
+
+#define APPORTABLE_URING_BATCH 64
+
+struct apportable_uring
+{
+    int fd;               /* -1 if io_uring cannot be used */
+    pid_t pid;            /* a forked child sets up its own */
+    void * sq_ring, * cq_ring;
+    size_t sq_ring_sz, cq_ring_sz;
+    struct io_uring_sqe * sqes;
+    size_t sqes_sz;
+    unsigned * sq_tail, * sq_mask, * sq_array;
+    unsigned * cq_head, * cq_tail, * cq_mask;
+    struct io_uring_cqe * cqes;
+    char * paths;         /* candidates of a batch, back to back */
+    size_t paths_cap;
+    size_t path_at[APPORTABLE_URING_BATCH];
+    int res[APPORTABLE_URING_BATCH];
+    struct statx stx[APPORTABLE_URING_BATCH];
+};
+
+
+static void _apportable_uring_close (apportable self, struct apportable_uring * ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->sqes_sz);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_sz);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_sz);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    self->_free(ring->paths);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static void _apportable_uring_free (apportable self)
+{
+    if (!self->_uring)
+        return;
+    _apportable_uring_close(self, self->_uring);
+    self->_free(self->_uring);
+    self->_uring = NULL;
+}
+
+/* map the rings of a new instance, ring->fd stays -1 if that fails */
+static void _apportable_uring_open (apportable self, struct apportable_uring * ring)
+{
+    struct io_uring_params p;
+    char * sq, * cq;
+    int fd;
+
+    memset(&p, 0, sizeof(p));
+    ring->pid = getpid();
+    if ((fd = (int) syscall(__NR_io_uring_setup, APPORTABLE_URING_BATCH, &p)) < 0)
+        return;
+    ring->fd = fd;
+    ring->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_sz > ring->sq_ring_sz)
+            ring->sq_ring_sz = ring->cq_ring_sz;
+        ring->cq_ring_sz = ring->sq_ring_sz;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = NULL;
+        goto fail;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    ring->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto fail;
+    }
+    sq = ring->sq_ring;
+    cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+    ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+    return;
+fail:
+    _apportable_uring_close(self, ring);
+    ring->pid = getpid();
+}
+
+/* statx() the first n candidates of the batch, results in ring->res;
+ * -1 if the ring failed */
+static int _apportable_uring_statx (struct apportable_uring * ring, unsigned n)
+{
+    struct io_uring_sqe * sqe;
+    struct io_uring_cqe * cqe;
+    unsigned tail, head, i, done;
+    long ret;
+
+    tail = *ring->sq_tail;
+    for (i = 0; i < n; i++, tail++) {
+        sqe = &ring->sqes[tail & *ring->sq_mask];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (unsigned long) (ring->paths + ring->path_at[i]);
+        sqe->len = STATX_TYPE | STATX_MODE;
+        sqe->off = (unsigned long) &ring->stx[i];
+        sqe->user_data = i;
+        ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    for (done = 0; done < n; ) {
+        ret = syscall(__NR_io_uring_enter, ring->fd, done ? 0 : n, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0 && errno != EINTR)
+            return -1;
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            if (cqe->user_data < n)
+                ring->res[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* whereis with batched probes: 1 with the path in cand if found, 0 if
+ * not, -1 to probe one by one instead */
+static int _apportable_whereis_uring (apportable self, const char * path, const char * pathlim,
+        const char * bin, size_t bin_l, int execonly, char * cand)
+{
+    struct apportable_uring * ring;
+    const char * sep;
+    char * grown;
+    size_t path_l, cand_l, at;
+    unsigned n, i;
+    int filetest, found, indexed;
+
+    if (!apportable_trylock(&self->_uring_lock))
+        return -1;   /* busy, do not wait for someone else's probes */
+    if (!(ring = self->_uring)) {
+        if ((ring = self->_calloc(1, sizeof(*ring)))) {
+            ring->fd = -1;
+            _apportable_uring_open(self, ring);
+        }
+        self->_uring = ring;
+    } else if (ring->pid != getpid()) {
+        /* unmap and close the parent's ring, in this process only */
+        _apportable_uring_close(self, ring);
+        _apportable_uring_open(self, ring);
+    }
+    if (!ring || ring->fd < 0) {
+        apportable_unlock(&self->_uring_lock);
+        return -1;
+    }
+
+    filetest = execonly ? X_OK : F_OK;
+    indexed = (self->_whereis_flags & APPORTABLE_WHEREIS_INDEX) && !strchr(bin, DIRSEP_C);
+    found = 0;
+    while (!found && path < pathlim) {
+        /* gather a batch */
+        for (n = 0, at = 0; n < APPORTABLE_URING_BATCH && path < pathlim; path = sep < pathlim ? sep + 1 : pathlim) {
+            sep = memchr(path, PATHSEP_C, pathlim - path);
+            if (!sep)
+                sep = pathlim;
+            path_l = sep - path;
+            cand_l = path_l + 1 + bin_l;
+            if (cand_l >= APPORTABLE_PATHBUF)
+                continue;
+            if (indexed && (!path_l || path[0] == DIRSEP_C)
+                    && !_apportable_pathindex_has(self, path, path_l, bin, bin_l))
+                continue;
+            if (at + cand_l + 1 > ring->paths_cap) {
+                if (!(grown = self->_calloc(1, 2 * (at + cand_l + 1)))) {
+                    found = -1;
+                    break;
+                }
+                if (at)
+                    memcpy(grown, ring->paths, at);
+                self->_free(ring->paths);
+                ring->paths = grown;
+                ring->paths_cap = 2 * (at + cand_l + 1);
+            }
+            memcpy(ring->paths + at, path, path_l);
+            ring->paths[at + path_l] = DIRSEP_C;
+            memcpy(ring->paths + at + path_l + 1, bin, bin_l + 1);
+            ring->path_at[n++] = at;
+            at += cand_l + 1;
+        }
+        if (found < 0)
+            break;
+        if (n && _apportable_uring_statx(ring, n) < 0) {
+            _apportable_uring_close(self, ring);   /* not again */
+            ring->pid = getpid();
+            found = -1;
+            break;
+        }
+        for (i = 0; i < n && !found; i++) {
+            /* statx fails wherever access() would, ask access() when unsure */
+            if (ring->res[i] == -ENOENT || ring->res[i] == -ENOTDIR || ring->res[i] == -EACCES
+                    || ring->res[i] == -ELOOP || ring->res[i] == -ENAMETOOLONG)
+                continue;
+            if (access(ring->paths + ring->path_at[i], filetest) == 0) {
+                strcpy(cand, ring->paths + ring->path_at[i]);
+                found = 1;
+            }
+        }
+    }
+    apportable_unlock(&self->_uring_lock);
+    return found;
+}
+
+#endif /*APPORTABLE_URING*/
+
+
+int apportable_whereis_flags (apportable a, int flags)
+{
+    apportable self;
+    int old;
+
+    self = APPORTABLE_STATE(a);
+    old = self->_whereis_flags;
+    self->_whereis_flags = flags;
+#if defined APPORTABLE_PATHINDEX
+    if (!(flags & APPORTABLE_WHEREIS_INDEX)) {
+        apportable_lock(&self->_pathindex_lock);
+        _apportable_pathindex_free(self);
+        apportable_unlock(&self->_pathindex_lock);
+    }
+    if (!(flags & APPORTABLE_WHEREIS_DIRFD)) {
+        apportable_lock(&self->_dirfds_lock);
+        _apportable_dirfds_free(self);
+        apportable_unlock(&self->_dirfds_lock);
+    }
+#endif
+#if defined APPORTABLE_URING
+    if (!(flags & APPORTABLE_WHEREIS_URING)) {
+        apportable_lock(&self->_uring_lock);
+        _apportable_uring_free(self);
+        apportable_unlock(&self->_uring_lock);
+    }
+#endif
+    return old;
+}
+
+
+/* test for bin in the search path directory path (path_l bytes), 1 with
+ * its path in cand (APPORTABLE_PATHBUF) if it is there */
+static int _apportable_whereis_probe (apportable self, const char * path, size_t path_l, const char * bin, size_t bin_l, int execonly, char * cand)
+{
+    size_t cand_l;
+    int found;
+#if defined _WIN32
+    wchar_t wcand[APPORTABLE_PATHBUF];
+#else
+    int filetest;
+#endif
+#if defined APPORTABLE_PATHINDEX
+    int probe;
+#endif
+
+    cand_l = path_l + 1 + bin_l;
+    if (cand_l >= APPORTABLE_PATHBUF)
+        return 0;
+#if !defined _WIN32
+    filetest = execonly ? X_OK : F_OK;
+#endif
+#if defined APPORTABLE_PATHINDEX
+    probe = -1;
+    /* relative directories move with the working directory, neither
+     * indexed nor kept open; listings only have plain names */
+    if (bin_l && (!path_l || path[0] == DIRSEP_C)) {
+        if ((self->_whereis_flags & APPORTABLE_WHEREIS_INDEX) && !strchr(bin, DIRSEP_C)
+                && !_apportable_pathindex_has(self, path, path_l, bin, bin_l))
+            return 0;
+        /* faccessat would ignore the directory for an absolute name */
+        if ((self->_whereis_flags & APPORTABLE_WHEREIS_DIRFD) && bin[0] != DIRSEP_C
+                && (probe = _apportable_dirfd_access(self, path, path_l, bin, filetest)) == 1)
+            return 0;
+    }
+#endif
+    /* construct candidate binary path */
+    memcpy(cand, path, path_l);
+    cand[path_l] = DIRSEP_C;
+    memcpy(&cand[path_l + 1], bin, bin_l + 1);
+#if defined APPORTABLE_PATHINDEX
+    if (probe == 0)
+        return 1;   /* settled by the open directory */
+#endif
+    APPORTABLE_TRACE_BEGIN("access");
+#if !defined _WIN32
+    found = access(cand, filetest) == 0;
+#else
+    found = MultiByteToWideChar(CP_UTF8, 0, cand, -1, wcand, APPORTABLE_PATHBUF)
+            && _waccess_s(wcand, 04) == 0;
+#endif
+    APPORTABLE_TRACE_END("access");
+    return found;
+}
+
+
+char * apportable_whereis(apportable a, const char * searchpath, const char * bin, int execonly)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    APPORTABLE_INTO_ALLOC(self, whereis_into, searchpath, bin, execonly);
+}
+
+/* whereis for the search path [path, pathlim), bin terminated */
+static char * _apportable_whereis_core (apportable self, const char * path, const char * pathlim,
+        const char * bin, size_t bin_l, int execonly, char * buf, size_t cap, size_t * needed)
+{
+    const char * sep;
+    size_t path_l;
+    char cand[APPORTABLE_PATHBUF];
+#if defined APPORTABLE_URING
+    int found;
+#endif
+
+#if defined APPORTABLE_URING
+    if ((self->_whereis_flags & APPORTABLE_WHEREIS_URING) && bin_l
+            && (found = _apportable_whereis_uring(self, path, pathlim, bin, bin_l, execonly, cand)) >= 0) {
+        if (found)
+            return _apportable_put(cand, strlen(cand), buf, cap, needed);
+        return _apportable_put(bin, bin_l, buf, cap, needed);
+    }
+#endif
+
+    for (; path < pathlim; path = sep < pathlim ? sep + 1 : pathlim) {
+        sep = memchr(path, PATHSEP_C, pathlim - path);
+        if (!sep)
+            sep = pathlim;
+        path_l = sep - path;
+        if (_apportable_whereis_probe(self, path, path_l, bin, bin_l, execonly, cand))
+            return _apportable_put(cand, path_l + 1 + bin_l, buf, cap, needed);   /* found a candidate */
+    }
+    return _apportable_put(bin, bin_l, buf, cap, needed);
 }
 
-/* for utf-8, will call into native UTF-16 */
-char * apportable_progfile (apportable a, const char * library_name) {
+char * apportable_whereis_into(apportable a, const char * searchpath, const char * bin, int execonly, char * buf, size_t cap, size_t * needed)
+{
     apportable self;
+    char * ret;
+
     self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
     if (!self->enabled)
-        return self->_strndup(a, (const char *)library_name, 0);
-
-	char * ret = NULL;
-    PWSTR wlibnam;
-    size_t ln_l, wlibnam_l;
-	if (library_name == NULL)
-		return apportable_wprogfile (self, NULL);
-    ln_l = strlen(library_name) + 1;
-    wlibnam_l = MultiByteToWideChar (CP_UTF8, 0, library_name, ln_l, NULL, 0);
-    wlibnam = self->_calloc (sizeof(char), wlibnam_l + 0);
-	if (!MultiByteToWideChar (CP_UTF8, 0, library_name, ln_l, wlibnam, wlibnam_l))
-    {
-		self->_free(wlibnam);
-		return NULL;			
-	}
-	ret = apportable_wprogfile (a, wlibnam);
-	self->_free(wlibnam);
-	return ret;
+        return NULL;
+    if (!searchpath)
+        searchpath = "";
+    APPORTABLE_TRACE_BEGIN("whereis");
+    ret = _apportable_whereis_core(self, searchpath, searchpath + strlen(searchpath), bin, strlen(bin), execonly, buf, cap, needed);
+    APPORTABLE_TRACE_END("whereis");
+    return ret;
 }
 
-#elif defined __APPLE__
+apportable_sv apportable_whereis_sv (apportable a, apportable_sv searchpath, apportable_sv bin, int execonly)
+{
+    apportable self;
+    apportable_sv ret = {NULL, 0};
+    char name[APPORTABLE_PATHBUF], * p;
 
-char * apportable_progfile (apportable a, const char * library_name) {
+    self = APPORTABLE_STATE(a);
+    /* the system would see the name cut short at a NUL */
+    if (!self->enabled || !bin.p || memchr(bin.p, 0, bin.n))
+        return ret;
+    if (bin.n >= sizeof(name)) {
+        /* in no directory, whereis gives it back */
+        if ((ret.p = p = mem_calloc(self, char, bin.n + 1))) {
+            memcpy(p, bin.p, bin.n);
+            ret.n = bin.n;
+        }
+        return ret;
+    }
+    /* the name goes to the system as is, terminated */
+    memcpy(name, bin.p, bin.n);
+    name[bin.n] = 0;
+    if (!searchpath.p)
+        searchpath.n = 0, searchpath.p = "";
+    APPORTABLE_INTO_ALLOC_SV(self, _apportable_whereis_core, searchpath.p, searchpath.p + searchpath.n, name, bin.n, execonly);
+}
+
+size_t apportable_whereis_many(apportable a, const char * searchpath, const char ** bins, size_t n, char ** out, int execonly)
+{
     apportable self;
+    const char * sep;
+    const char * pathlim;
+    const char * path;
+    size_t path_l;
+    size_t * bin_l;
+    size_t i, pending, found;
+    char cand[APPORTABLE_PATHBUF];
+
     self = APPORTABLE_STATE(a);
-    if (!self->enabled)
-        return self->_strndup(self, library_name, 0);
+    for (i = 0; i < n; i++)
+        out[i] = NULL;
+    if (!self->enabled || !n || !(bin_l = mem_calloc(self, size_t, n)))
+        return 0;
 
-    const char* library_base_name = library_name ? strrchr(library_name, DIRSEP_C) : NULL;
-    if (!library_base_name)
-        library_base_name = library_name;
-    else
-        library_base_name += 1;   // skip found '/'
-    char* library_file = NULL;
+    for (i = 0; i < n; i++)
+        bin_l[i] = strlen(bins[i]);
+    path = searchpath ? searchpath : "";
+    pathlim = path + strlen(path);
+    pending = n;
+    found = 0;
 
-    const char * image_name = NULL;
-    const char * library_name_sep = NULL;
-    unsigned long image_count = _dyld_image_count();
-    errno = 0;
-    for (unsigned long i = 0; i < image_count; i++) {
-        image_name = (const char *)_dyld_get_image_name(i);  // dyld owns string
-        if (!image_name || !image_name[0])
-            continue;
-        library_name_sep = strrchr(image_name, '/');
-        if (!library_name_sep)
-            library_name_sep = image_name;
-       	else
-       		library_name_sep += 1;   // skip found '/'
-        if (!library_name || !strcmp(library_name_sep, library_base_name)) {
-            library_file = self->_strndup(a, image_name, PATH_MAX);
-            break;
+    /* each directory once, settling every name still pending there */
+    for (; pending && path < pathlim; path = sep < pathlim ? sep + 1 : pathlim) {
+        sep = memchr(path, PATHSEP_C, pathlim - path);
+        if (!sep)
+            sep = pathlim;
+        path_l = sep - path;
+        for (i = 0; i < n; i++) {
+            if (out[i] || bin_l[i] == (size_t) -1
+                    || !_apportable_whereis_probe(self, path, path_l, bins[i], bin_l[i], execonly, cand))
+                continue;
+            if (!(out[i] = _apportable_dup(self, cand, path_l + 1 + bin_l[i] + 1)))
+                bin_l[i] = (size_t) -1;   /* out of memory, leave it NULL */
+            else
+                found++;
+            pending--;
         }
     }
-    return library_file;
+    for (i = 0; i < n; i++)
+        if (!out[i] && bin_l[i] != (size_t) -1)
+            out[i] = _apportable_dup(self, bins[i], bin_l[i] + 1);
+    mem_free(self, bin_l);
+    return found;
 }
 
-#elif defined __GNUC__
 
-extern char *program_invocation_name;
 
-wchar_t * apportable_progfile (apportable a, const wchar_t * library_name) {
+/* pathexp of the template_l bytes at template, library_path_l at library_path */
+static char * _apportable_pathexp_core (const char * template, size_t template_l, const char * library_path, size_t library_path_l,
+        char * buf, size_t cap, size_t * needed)
+{
+    const char * exec_path_sym;
+    size_t exec_path_symlen;
+    const char * library_name;
+    const char * executable_path;
+    size_t exec_path_len;
+    const char * sub_template;
+    size_t sub_template_len;
+    size_t result_len;
+
+    if (needed)
+        *needed = 0;
+    exec_path_sym = "$ORIGIN";
+    exec_path_symlen = strlen(exec_path_sym);
+
+    /* if not starting with $ORIGIN, return straight away a copy of the template, unaltered */
+    if (template_l < exec_path_symlen || memcmp(template, exec_path_sym, exec_path_symlen) != 0)
+        return _apportable_put(template, template_l, buf, cap, needed);
+
+    /* the directory part of library_path, separator included */
+    library_name = _apportable_lastsep(library_path, library_path_l);
+    library_name = library_name ? library_name + 1 : library_path;
+    if (library_name - library_path != 0) {
+        executable_path = library_path;
+        exec_path_len = library_name - library_path;
+    } else {
+        executable_path = "." DIRSEP_S;
+        exec_path_len = strlen(executable_path);
+    }
+
+    sub_template = &template[exec_path_symlen];
+    sub_template_len = template_l - exec_path_symlen;
+    while (sub_template_len && sub_template[0] == DIRSEP_C)
+        sub_template += 1, sub_template_len--;
+    result_len = exec_path_len + sub_template_len;
+
+    // concatenate
+    if (needed)
+        *needed = result_len + 1;
+    if (!buf || cap < result_len + 1)
+        return NULL;
+    memcpy(buf, executable_path, exec_path_len);                       // "@executable_path"
+    memcpy(&buf[exec_path_len], sub_template, sub_template_len);       // "/../share/"
+    buf[result_len] = 0;
+    return buf;
+}
+
+static char * _apportable_pathexp_sv_into (apportable self, apportable_sv template, apportable_sv library_path, char * buf, size_t cap, size_t * needed)
+{
+    (void) self;
+    return _apportable_pathexp_core(template.p, template.n, library_path.p, library_path.n, buf, cap, needed);
+}
+
+char * apportable_pathexp(apportable a, const char * template, const char * library_path)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    APPORTABLE_INTO_ALLOC(self, pathexp_into, template, library_path);
+}
+
+char * apportable_pathexp_into(apportable a, const char * template, const char * library_path, char * buf, size_t cap, size_t * needed)
+{
     apportable self;
+
     self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
     if (!self->enabled)
-        return self->_strndup(a, library_name, 0);
+        return NULL;
 
-	const char* library_base_name = library_name ? strrchr(library_name, DIRSEP_C) : NULL;
-    if (!library_base_name)
-        library_base_name = library_name;
-    else
-        library_base_name += 1;   // skip found '/'
-    char * library_file = NULL;
-    char * image_name;
-    char * image_name_real;
-    char * library_name_sep;
-    FILE * cmdline;
-    
-    void *handle = dlopen(NULL, RTLD_LAZY);
-    if (!handle)
-        return NULL;
-    const struct link_map * link_map = 0;
-    int ret = dlinfo(handle, RTLD_DI_LINKMAP, &link_map);
-    if (ret || !link_map) {
-        dlclose(handle);
-        return NULL;
-    }
-    image_name_real = realpath(program_invocation_name, NULL);
-    /* sometimes program_invocation_name gets wiped for reasons of beauty... */
-    if (!image_name_real || !image_name_real[0]) {
-        if ((cmdline = fopen("/proc/self/cmdline", "rb"))) {
-            char *arg = 0;
-            size_t size = 0;
-            while (getdelim(&arg, &size, 0, cmdline) != -1) {
-                image_name_real = arg;
-                break;
-            }
-            fclose(cmdline);
-        }        
-    }
-    while (link_map->l_prev)
-        link_map = link_map->l_prev;
-    for(int i = 0; link_map->l_next != NULL; link_map = link_map->l_next, i++) {
-        if (link_map->l_name && link_map->l_name[0])
-            image_name = link_map->l_name;   /* Absolute pathname according to dlinfo(3) */
-        else {
-            if (i == 0 && image_name_real != NULL)
-                image_name = image_name_real;
-        }
-        if (!image_name || !image_name[0])
-            continue;
-        library_name_sep = strrchr(image_name, DIRSEP_C);
-        if (!library_name_sep)
-            library_name_sep = image_name;
-        else
-            library_name_sep += 1;   // skip found '/'
-        if (!library_name || !strcmp(library_name_sep, library_base_name)) {
-            library_file = self->_strndup(a, image_name, PATH_MAX);
-            break;
-        }
+    if (!library_path && _apportable_exe_get())
+        library_path = _apportable_exe.path;
+    if (!library_path || !template)
+        return NULL;
+    return _apportable_pathexp_core(template, strlen(template), library_path, strlen(library_path), buf, cap, needed);
+}
+
+apportable_sv apportable_pathexp_sv (apportable a, apportable_sv template, apportable_sv library_path)
+{
+    apportable self;
+    apportable_sv none = {NULL, 0};
+
+    self = APPORTABLE_STATE(a);
+    if (!self->enabled || !template.p)
+        return none;
+    if (!library_path.p && _apportable_exe_get()) {
+        library_path.p = _apportable_exe.path;
+        library_path.n = _apportable_exe.path_l;
     }
-    if (image_name_real)
-        free(image_name_real);
-    return library_file;
+    if (!library_path.p)
+        return none;
+    APPORTABLE_INTO_ALLOC_SV(self, _apportable_pathexp_sv_into, template, library_path);
 }
 
 
-// #else
+/* Templates for apportable_template_compile: literal text and tokens,
+ * ld.so style.  $LIB and $PLATFORM do not change while the process runs
+ * and are folded into the literals; $ORIGIN and ${ENV:NAME} are left to
+ * each expansion. */
 
-// char * apportable_progfile (apportable a, const wchar_t * library_name) {
-// 	return NULL;
-// }
+/* $LIB is fixed at build time: lib/<triplet> with APPORTABLE_MULTIARCH
+ * (as Debian's ld.so has it, the Makefile and setup.py pass the one the
+ * compiler or Python knows), else lib64 or lib as elsewhere; packagers
+ * with another layout define APPORTABLE_LIB */
+#if !defined APPORTABLE_LIB
+# if defined APPORTABLE_MULTIARCH
+#  define APPORTABLE_LIB "lib/" APPORTABLE_MULTIARCH
+# elif defined __linux__ && (defined __LP64__ || defined _WIN64)
+#  define APPORTABLE_LIB "lib64"
+# else
+#  define APPORTABLE_LIB "lib"
+# endif
+#endif
 
-// char * apportable_pathexp(apportable a, const wchar_t * template, const wchar_t * library_path) {
-// 	return self->_strndup(a, template, strlen(template));
-// }
+#define APPORTABLE_TOK_TEXT 0
+#define APPORTABLE_TOK_ORIGIN 1
+#define APPORTABLE_TOK_ENV 2   /* s is the variable name, NUL terminated */
+#define APPORTABLE_TOK_LIB 3        /* only while compiling */
+#define APPORTABLE_TOK_PLATFORM 4
 
-#endif /*_WIN32, __APPLE__, ...*/
+struct apportable_tmpl_tok
+{
+    int kind;
+    const char * s;
+    size_t n;
+};
 
+struct apportable_tmpl
+{
+    size_t count;
+    size_t fixed_l;       /* length of all the text tokens */
+    int origin;           /* number of $ORIGIN tokens */
+    struct apportable_tmpl_tok tok[1];   /* count of them, then the text */
+};
 
-char * apportable_whereis(apportable a, const char * searchpath, const char * bin, int execonly)
+
+/* value of $PLATFORM, into buf of 64 */
+static void _apportable_platform (char * buf)
 {
-    apportable self;
-    char * sep;
-    char * pathbuf;
-    char * pathlim;
-    char * path;
-    size_t bin_l;
-    char * cand;
-    size_t cand_l;
-    wchar_t * wcand;
-#if defined _WIN32
-    size_t wcand_l;
+    const char * p;
+#if defined __linux__
+    p = (const char *) getauxval(AT_PLATFORM);
+#elif defined _WIN32
+# if defined _M_ARM64 || defined __aarch64__
+    p = "arm64";
+# elif defined _WIN64
+    p = "x86_64";
+# else
+    p = "i686";
+# endif
+#else
+    struct utsname u;
+
+    p = uname(&u) == 0 ? u.machine : NULL;
 #endif
-    int filetest;
+    if (!p)
+        p = "";
+    strncpy(buf, p, 63);
+    buf[63] = 0;
+}
+
+/* recognize the token at template ($ included, lim the end), its length
+ * or 0 */
+static size_t _apportable_tmpl_token (const char * template, const char * lim, int * kind, const char ** s, size_t * n)
+{
+    static const char * const names[] = {"ORIGIN", "LIB", "PLATFORM"};
+    static const int kinds[] = {APPORTABLE_TOK_ORIGIN, APPORTABLE_TOK_LIB, APPORTABLE_TOK_PLATFORM};
+    const char * p, * end;
+    size_t name_l, i;
+
+    *s = NULL;
+    *n = 0;
+    p = template + 1;
+    if (p < lim && *p == '{') {
+        p += 1;
+        if (!(end = memchr(p, '}', lim - p)))
+            return 0;
+        if (end > p + 4 && !memcmp(p, "ENV:", 4)) {
+            *kind = APPORTABLE_TOK_ENV;
+            *s = p + 4;
+            *n = end - p - 4;
+            return end + 1 - template;
+        }
+        name_l = end - p;
+        end += 1;
+    } else {
+        for (end = p; end < lim && ((*end >= 'A' && *end <= 'Z') || (*end >= 'a' && *end <= 'z')
+                || (*end >= '0' && *end <= '9') || *end == '_'); end++)
+            ;
+        name_l = end - p;
+    }
+    for (i = 0; i < sizeof(names) / sizeof(*names); i++)
+        if (strlen(names[i]) == name_l && !memcmp(p, names[i], name_l)) {
+            *kind = kinds[i];
+            return end - template;
+        }
+    return 0;
+}
+
+struct apportable_tmpl * apportable_template_compile (apportable a, const char * template)
+{
+    apportable_sv sv;
+
+    if (!template)
+        return NULL;
+    sv.p = template;
+    sv.n = strlen(template);
+    return apportable_template_compile_sv(a, sv);
+}
+
+struct apportable_tmpl * apportable_template_compile_sv (apportable a, apportable_sv template)
+{
+    apportable self;
+    struct apportable_tmpl * t;
+    struct apportable_tmpl_tok * tok;
+    const char * p, * s, * lim;
+    char platform[64];
+    size_t len, count, text_l, n;
+    char * text;
+    int kind, pass, in_text;
 
     self = APPORTABLE_STATE(a);
-    if (!self->enabled)
+    if (!template.p)
         return NULL;
+    lim = template.p + template.n;
+    _apportable_platform(platform);
 
-    pathbuf = (self->_strndup(self, searchpath, 0));
-    pathlim = pathbuf + strlen(pathbuf);
-    path = pathbuf;
-    bin_l = strlen(bin);
+    /* measure, then fill; the text follows the token vector */
+    t = NULL;
+    text = NULL;
+    count = text_l = 0;
+    for (pass = 0; pass < 2; pass++) {
+        if (pass) {
+            if (!(t = self->_calloc(1, sizeof(*t) + count * sizeof(*t->tok) + text_l + 1)))
+                return NULL;
+            text = (char *) &t->tok[count ? count : 1];
+        }
+        count = text_l = 0;
+        in_text = 0;
+        for (p = template.p; p < lim; p += len) {
+            if (*p != '$' || !(len = _apportable_tmpl_token(p, lim, &kind, &s, &n))) {
+                kind = APPORTABLE_TOK_TEXT;
+                s = p;
+                n = len = 1;
+            } else if (kind == APPORTABLE_TOK_LIB) {
+                kind = APPORTABLE_TOK_TEXT;
+                s = APPORTABLE_LIB;
+                n = strlen(s);
+            } else if (kind == APPORTABLE_TOK_PLATFORM) {
+                kind = APPORTABLE_TOK_TEXT;
+                s = platform;
+                n = strlen(s);
+            }
+            tok = pass ? &t->tok[count] : NULL;
+            if (kind == APPORTABLE_TOK_TEXT && in_text) {
+                /* run on into the previous text token */
+                if (pass) {
+                    memcpy(text + text_l, s, n);
+                    tok[-1].n += n;
+                    t->fixed_l += n;
+                }
+                text_l += n;
+                continue;
+            }
+            in_text = kind == APPORTABLE_TOK_TEXT;
+            if (pass) {
+                tok->kind = kind;
+                tok->s = text + text_l;
+                tok->n = kind == APPORTABLE_TOK_ORIGIN ? 0 : n;
+                if (kind != APPORTABLE_TOK_ORIGIN)
+                    memcpy(text + text_l, s, n);
+                if (kind == APPORTABLE_TOK_ORIGIN)
+                    t->origin++;
+                else if (kind == APPORTABLE_TOK_TEXT)
+                    t->fixed_l += n;
+            }
+            if (kind == APPORTABLE_TOK_TEXT)
+                text_l += n;
+            else if (kind == APPORTABLE_TOK_ENV)
+                text_l += n + 1;   /* terminated, for getenv */
+            count++;
+        }
+    }
+    t->count = count;
+    return t;
+}
 
-    while (path < pathlim) {
-        sep = strchr(path, PATHSEP_C);
-        if (!sep)
-            sep = pathlim;
-        *sep = 0;
-        /* construct candidate binary path */
-        cand_l = strlen(path) + strlen(DIRSEP_S) + bin_l + 1;
-        if (!(cand = self->_calloc(1, cand_l)))
-        {
-            self->_free(pathbuf);
+void apportable_template_free (apportable a, struct apportable_tmpl * t)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    self->_free(t);
+}
+
+char * apportable_template_expand (apportable a, const struct apportable_tmpl * t, const char * library_path)
+{
+    apportable self;
+
+    self = APPORTABLE_STATE(a);
+    APPORTABLE_INTO_ALLOC(self, template_expand_into, t, library_path);
+}
+
+/* template_expand_into for the library_path_l bytes at library_path */
+static char * _apportable_template_expand_core (apportable self, const struct apportable_tmpl * t,
+        const char * library_path, size_t library_path_l, char * buf, size_t cap, size_t * needed)
+{
+    char progfile[APPORTABLE_PATHBUF];
+    const char * origin;
+    size_t origin_l, result_l, env_l, left, n, i;
+    const char * sep;
+    char * p;
+
+    if (needed)
+        *needed = 0;
+
+    /* the directory of library_path, by default the program's */
+    origin = NULL;
+    origin_l = 0;
+    if (t->origin) {
+        if (!library_path && _apportable_exe_get()) {
+            library_path = _apportable_exe.path;
+            library_path_l = _apportable_exe.path_l;
+        }
+        if (!library_path && self->progfile_into(self, NULL, progfile, sizeof(progfile), &i)) {
+            library_path = progfile;
+            library_path_l = i - 1;
+        }
+        if (!library_path)
             return NULL;
+        if ((sep = _apportable_lastsep(library_path, library_path_l))) {
+            origin = library_path;
+            origin_l = sep - library_path;
+        } else {
+            origin = ".";
+            origin_l = 1;
         }
-        strcpy(cand, path);
-        strcat(cand, DIRSEP_S);
-        strcat(cand, bin);
-        cand[cand_l - 1] = 0;
-#if !defined _WIN32
-        wcand = NULL;
-        filetest = execonly ? X_OK : F_OK;
-        if (access(cand, filetest) == -1)
-#else
-        wcand_l = MultiByteToWideChar(CP_UTF8, 0, cand, cand_l, NULL, 0);
-        wcand = self->_calloc(sizeof(wchar_t), wcand_l + 0);
-        MultiByteToWideChar(CP_UTF8, 0, cand, cand_l, wcand, wcand_l);
-        if (_waccess_s(wcand, 04) != 0)
-#endif
-        {
-            if (wcand)
-                self->_free(wcand);
-            path = sep < pathlim ? sep + 1 : pathlim;
-            self->_free(cand);
-            continue;
+    }
+
+    result_l = t->fixed_l + t->origin * origin_l;
+    for (i = 0; i < t->count; i++)
+        if (t->tok[i].kind == APPORTABLE_TOK_ENV) {
+            self->ugetenv_into(self, (char *) t->tok[i].s, NULL, 0, &env_l);
+            result_l += env_l ? env_l - 1 : 0;
+        }
+    if (needed)
+        *needed = result_l + 1;
+    if (!buf || cap < result_l + 1)
+        return NULL;
+
+    left = cap - 1;
+    for (p = buf, i = 0; i < t->count; i++) {
+        if (t->tok[i].kind == APPORTABLE_TOK_ENV) {
+            if (!self->ugetenv_into(self, (char *) t->tok[i].s, p, left + 1, &env_l))
+                goto changed;
+            n = env_l - 1;
+        } else {
+            n = t->tok[i].kind == APPORTABLE_TOK_TEXT ? t->tok[i].n : origin_l;
+            if (n > left)
+                goto changed;
+            memcpy(p, t->tok[i].kind == APPORTABLE_TOK_TEXT ? t->tok[i].s : origin, n);
         }
-        /* found a candidate */
-        self->_free(pathbuf);
-        return cand;
+        p += n;
+        left -= n;
     }
-    free(pathbuf);
-    return self->_strndup(self, bin, 0);
+    *p = 0;
+    return buf;
+changed:
+    /* the environment grew since it was measured, by another thread */
+    if (needed)
+        *needed = 0;
+    return NULL;
 }
 
+char * apportable_template_expand_into (apportable a, const struct apportable_tmpl * t, const char * library_path, char * buf, size_t cap, size_t * needed)
+{
+    apportable self;
 
+    self = APPORTABLE_STATE(a);
+    if (needed)
+        *needed = 0;
+    if (!self->enabled || !t)
+        return NULL;
+    return _apportable_template_expand_core(self, t, library_path, library_path ? strlen(library_path) : 0, buf, cap, needed);
+}
 
-char * apportable_pathexp(apportable a, const char * template, const char * library_path)
+apportable_sv apportable_template_expand_sv (apportable a, const struct apportable_tmpl * t, apportable_sv library_path)
 {
     apportable self;
-    char * exec_path_sym;
-    unsigned long exec_path_symlen;
-    char * result;
-    const char * library_name;
-    char * executable_path_p;
-    char * executable_path;
-    unsigned long exec_path_len;
-    unsigned long template_len;
-    const char * sub_template;
-    unsigned long sub_template_len; 
-    unsigned long result_len;
+    apportable_sv none = {NULL, 0};
 
     self = APPORTABLE_STATE(a);
-    if (!self->enabled)
-        return NULL;
+    if (!self->enabled || !t)
+        return none;
+    APPORTABLE_INTO_ALLOC_SV(self, _apportable_template_expand_core, t, library_path.p, library_path.n);
+}
 
-    if (!library_path || !template)
+
+/* apportable_template: resolved once per template, then the same string
+ * for the life of the state.  Readers take no lock: a slot's key is
+ * published after its value, and a full table is replaced by a larger
+ * copy, the old one staying valid (and chained for apportable_fini). */
+
+struct apportable_interned_slot
+{
+    const char * key;     /* NULL for a free slot, shares the block with value */
+    const char * value;
+    size_t hash;
+};
+
+struct apportable_interned
+{
+    struct apportable_interned * older;
+    size_t count;
+    size_t mask;
+    struct apportable_interned_slot slots[1];   /* mask + 1 */
+};
+
+
+static const char * _apportable_interned_find (struct apportable_interned * table, const char * key, size_t hash)
+{
+    struct apportable_interned_slot * slot;
+    const char * k;
+    size_t i;
+
+    for (i = hash & table->mask; ; i = (i + 1) & table->mask) {
+        slot = &table->slots[i];
+        if (!(k = apportable_load_ptr(&slot->key)))
+            return NULL;
+        if (slot->hash == hash && (k == key || !strcmp(k, key)))
+            return slot->value;
+    }
+}
+
+static struct apportable_interned * _apportable_interned_new (apportable self, size_t mask, struct apportable_interned * older)
+{
+    struct apportable_interned * table;
+    struct apportable_interned_slot * e;
+    size_t i, j;
+
+    if (!(table = self->_calloc(1, sizeof(*table) + mask * sizeof(*table->slots))))
         return NULL;
- 
-    exec_path_sym = "$ORIGIN";
-    exec_path_symlen = strlen(exec_path_sym);
-    result = NULL;
-    
-    /* if not starting with $ORIGIN, return straight away a copy of the template, unaltered */
-    if (strncmp(template, exec_path_sym, exec_path_symlen) != 0) {
-        result = self->_strndup(a, template, 0);
-        return result;
+    table->mask = mask;
+    table->older = older;
+    for (i = 0; older && i <= older->mask; i++) {
+        if (!(e = &older->slots[i])->key)
+            continue;
+        for (j = e->hash & mask; table->slots[j].key; j = (j + 1) & mask)
+            ;
+        table->slots[j] = *e;
+        table->count++;
     }
+    return table;
+}
 
-    library_name = strrchr(library_path, DIRSEP_C);
-    library_name = library_name ? library_name + 1 : library_path;
-    if (library_name - library_path != 0) {
-        executable_path_p = self->_strndup(a, library_path, library_name - library_path);
-        executable_path = executable_path_p;
-    } else {
-        executable_path_p = NULL;
-        executable_path = "." DIRSEP_S;
+static void _apportable_interned_free (apportable self)
+{
+    struct apportable_interned * table, * older;
+    size_t i;
+
+    if (!(table = self->_interned))
+        return;
+    for (i = 0; i <= table->mask; i++)
+        self->_free((void *) table->slots[i].key);   /* the strings of all tables */
+    for (; table; table = older) {
+        older = table->older;
+        self->_free(table);
     }
+    self->_interned = NULL;
+}
 
-    exec_path_len = strlen(executable_path);
-    template_len = strlen(template);
-    sub_template = &template[exec_path_symlen];
-    while (sub_template[0] == DIRSEP_C && executable_path[0] == DIRSEP_C)
-        sub_template += 1;
-    sub_template_len = template_len - exec_path_symlen;
-    result_len = template_len + exec_path_len - exec_path_symlen;
+/* resolve template on self, or return it as is */
+static const char * _apportable_intern (apportable self, const char * template)
+{
+    struct apportable_interned * table;
+    struct apportable_interned_slot * slot;
+    struct apportable_tmpl * t;
+    const char * found;
+    char * value, * block;
+    size_t hash, key_l, value_l, i;
 
-    // concatenate
-    result = calloc(1, result_len + 1);
-    memcpy(result, executable_path, exec_path_len);                   // "@executable_path"
-    memcpy(&result[exec_path_len], sub_template, sub_template_len);   // "/../share/"
-    result[result_len] = 0;                                           // (again)
-
-    if (executable_path_p)
-        free(executable_path_p);
-    return result;
+    key_l = strlen(template);
+    hash = _apportable_hash(template, key_l);
+    if ((table = apportable_load_ptr(&self->_interned))
+            && (found = _apportable_interned_find(table, template, hash)))
+        return found;
+
+    /* first use: resolve without the lock, keep the first one stored */
+    if (!self->enabled || !(t = apportable_template_compile(self, template)))
+        return template;
+    value = self->template_expand(self, t, NULL);
+    apportable_template_free(self, t);
+    if (!value)
+        return template;
+    value_l = strlen(value);
+    block = self->_calloc(1, key_l + 1 + value_l + 1);
+    if (block) {
+        memcpy(block, template, key_l);
+        memcpy(block + key_l + 1, value, value_l);
+    }
+    mem_free(self, value);
+    if (!block)
+        return template;
+
+    apportable_lock(&self->_interned_lock);
+    table = self->_interned;
+    if (table && (found = _apportable_interned_find(table, template, hash))) {
+        apportable_unlock(&self->_interned_lock);
+        self->_free(block);
+        return found;
+    }
+    if (!table || (table->count + 1) * 2 > table->mask + 1) {
+        if (!(table = _apportable_interned_new(self, table ? 2 * table->mask + 1 : 15, table))) {
+            apportable_unlock(&self->_interned_lock);
+            self->_free(block);
+            return template;
+        }
+        apportable_store_ptr(&self->_interned, table);
+    }
+    for (i = hash & table->mask; table->slots[i].key; i = (i + 1) & table->mask)
+        ;
+    slot = &table->slots[i];
+    slot->value = block + key_l + 1;
+    slot->hash = hash;
+    apportable_store_ptr(&slot->key, (const char *) block);
+    table->count++;
+    apportable_unlock(&self->_interned_lock);
+    return block + key_l + 1;
+}
+
+const char * apportable_template (const char * template)
+{
+    apportable self;
+
+    if (!template)
+        return NULL;
+    self = APPORTABLE_STATE(NULL);
+    return _apportable_intern(self, template);
 }
 
 
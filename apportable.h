@@ -33,13 +33,51 @@
 #define APPORTABLE_H
 
 
+struct apportable_tmpl;   /* see apportable_template_compile */
+struct apportable_dirs;   /* see apportable_dirs */
+struct apportable_stat;   /* see apportable_stats */
+
+/* a string by pointer and length, not necessarily terminated */
+typedef struct apportable_sv
+{
+	const char * p;
+	size_t n;
+}
+	apportable_sv;
+
 typedef struct apportable_t
 {
-	int initialized;   /* keep this first, for initialization = {0} */
+	int initialized;   /* keep this first, for initialization = {0}; 1 once ready */
 	int enabled;
 	char * _iconv_wchar_t;
+	void * _iconv[2];   /* iconv_t, opened once by apportable_init */
+	volatile long _iconv_lock[2];
 	void * (*_calloc) (size_t, size_t);
 	void (*_free) (void *);
+	struct apportable_arena * _arena;   /* see apportable_arena_begin */
+	struct apportable_progcache * _progcache;   /* progfile results */
+	volatile long _progcache_lock;
+	struct apportable_segindex * _segindex;   /* loaded segments, for progfile_for_address */
+	volatile long _segindex_lock;
+	int _whereis_flags;   /* see apportable_whereis_flags */
+	struct apportable_pathindex * _pathindex;   /* directory listings for whereis */
+	volatile long _pathindex_lock;
+	struct apportable_dirfds * _dirfds;   /* open search path directories */
+	volatile long _dirfds_lock;
+	struct apportable_uring * _uring;   /* batched probes for whereis */
+	volatile long _uring_lock;
+	struct apportable_interned * volatile _interned;   /* see apportable_template */
+	volatile long _interned_lock;
+	unsigned long _scratch_key;   /* thread-local scratch buffers, if _scratch_keyed */
+	int _scratch_keyed;
+	struct apportable_scratch * _scratch;   /* every thread's, for apportable_fini */
+	volatile long _scratch_lock;
+	struct apportable_dirs * volatile _dirs;   /* see apportable_dirs */
+	volatile long _dirs_lock;
+	struct apportable_env * volatile _env;   /* see apportable_env_refresh */
+	volatile long _env_lock;
+	struct apportable_stats * volatile _stats;   /* see apportable_stats_enable */
+	volatile long _stats_lock;
 
 	char * (*_strndup) (struct apportable_t *, const char *, size_t);
 	wchar_t * (*_wcsndup) (struct apportable_t *, const wchar_t *, size_t);
@@ -54,14 +92,64 @@ typedef struct apportable_t
 	char * (*whereis) (struct apportable_t *, const char *, const char *, int);
 	char * (*progfile) (struct apportable_t *, const char *);
 	char * (*pathexp) (struct apportable_t *, const char *, const char *);
+
+	char * (*wutf8_into) (struct apportable_t *, const wchar_t *, char *, size_t, size_t *);
+	wchar_t * (*uwchar_t_into) (struct apportable_t *, const char *, wchar_t *, size_t, size_t *);
+	char * (*ugetenv_into) (struct apportable_t *, char *, char *, size_t, size_t *);
+	char * (*wugetenv_into) (struct apportable_t *, wchar_t *, char *, size_t, size_t *);
+	char * (*whereis_into) (struct apportable_t *, const char *, const char *, int, char *, size_t, size_t *);
+	char * (*progfile_into) (struct apportable_t *, const char *, char *, size_t, size_t *);
+	char * (*pathexp_into) (struct apportable_t *, const char *, const char *, char *, size_t, size_t *);
+	char * (*progfile_for_address) (struct apportable_t *, const void *);
+	char * (*progfile_for_address_into) (struct apportable_t *, const void *, char *, size_t, size_t *);
+
+	size_t (*whereis_many) (struct apportable_t *, const char *, const char **, size_t, char **, int);
+	char * (*template_expand) (struct apportable_t *, const struct apportable_tmpl *, const char *);
+	char * (*template_expand_into) (struct apportable_t *, const struct apportable_tmpl *, const char *, char *, size_t, size_t *);
 }
 	apportable_t, * apportable;
 
 
 void apportable_new (apportable a);
 void apportable_init (apportable a, int enabled);
+void apportable_fini (apportable a);
 apportable apportable_getstate (apportable a);
 
+/* Results are allocated with apportable_calloc and released with
+ * apportable_free.  Between apportable_arena_begin and _end they come
+ * from an arena instead, and apportable_arena_reset drops them all. */
+void * apportable_calloc (apportable a, size_t count, size_t size);
+void apportable_free (apportable a, void * p);
+int apportable_arena_begin (apportable a, size_t size);
+void apportable_arena_reset (apportable a);
+void apportable_arena_end (apportable a);
+
+/* Allocation statistics, if built with APPORTABLE_STATS (GCC and Clang):
+ * apportable_stats_enable wraps _calloc and _free of an initialized state
+ * with counting hooks, until apportable_fini.  Allocations are attributed
+ * to the API function they happen in, the outermost one if calls nest;
+ * results count as outstanding until given to apportable_free.  Best
+ * enabled before other threads use the state: a call already under way
+ * may finish on the allocator it started with.  Returns 0, or -1 if out
+ * of memory or not built with it. */
+struct apportable_stat
+{
+	const char * name;    /* of the function, "" for the totals */
+	size_t calls;         /* to the function */
+	size_t allocs, frees, bytes;
+	size_t live;          /* bytes allocated and not freed */
+	size_t peak;          /* most live bytes */
+	size_t outstanding;   /* allocations not freed */
+};
+int apportable_stats_enable (apportable a);
+
+/* The totals to *total and up to n functions to fn[] (either may be NULL),
+ * returns how many functions there are; 0 if not enabled. */
+size_t apportable_stats (apportable a, struct apportable_stat * total, struct apportable_stat * fn, size_t n);
+
+/* Start the counts afresh; what is live stays, and is the new peak. */
+void apportable_stats_reset (apportable a);
+
 char * apportable_strndup (apportable a, const char * str, size_t size);
 wchar_t * apportable_wcsndup (apportable a, const wchar_t * str, size_t syms);
 
@@ -72,9 +160,126 @@ wchar_t * apportable_uwchar_t_free (apportable a, char * s);
 char * apportable_ugetenv (apportable a, char * var);
 char * apportable_wugetenv (apportable a, wchar_t * wvar);
 
+/* Take a copy of the environment, or a new one, for lookups on this state:
+ * from then on apportable_env, ugetenv and wugetenv answer from a hash
+ * table of it and no longer see changes until the next refresh.  Returns
+ * 0, or -1 if out of memory (the previous copy, if any, stays in use). */
+int apportable_env_refresh (apportable a);
+
+/* The value of an environment variable, borrowed: from the copy if one was
+ * taken (valid until apportable_fini, refreshes included), else from the
+ * environment itself (valid until it changes; on Windows converted into
+ * a buffer of the calling thread, valid until its next call on the state).
+ * p is NULL if unset. */
+apportable_sv apportable_env (apportable a, const char * name);
+
 char * apportable_whereis (apportable a, const char * searchpath, const char * bin, int execonly);
 char * apportable_progfile (apportable a, const char * library_name);
 char * apportable_pathexp (apportable a, const char * template, const char * library_path);
 
+/* progfile for the object (program or library) holding addr, such as the
+ * address of one of its functions: a library finds its own path without
+ * knowing its name.  NULL if addr is in none. */
+char * apportable_progfile_for_address (apportable a, const void * addr);
+
+/* The program's canonical path, and the directory it is in ("." if none),
+ * found once per process: by the first apportable_init, or before main
+ * if built with APPORTABLE_CONSTRUCTOR (GCC and Clang).  The strings stay
+ * valid and unchanged, and are returned without allocating or asking the
+ * system again; NULL (and 0 in *len) if the program is unknown or a is
+ * disabled.  pathexp and template expansion fall back to them when
+ * library_path is NULL. */
+const char * apportable_exepath (apportable a, size_t * len);
+const char * apportable_origin (apportable a, size_t * len);
+
+/* Installation directories, as configure names them, relocated to where
+ * the program is: prefix is its directory, less a last component of bin,
+ * sbin, lib, lib64 or libexec, and the others are below prefix as with
+ * the default configure options (APPORTABLE_SYSCONFDIR and so on change
+ * those at build time).  Built on first use and kept by the state, the
+ * strings are terminated as well; NULL if the program is unknown or a is
+ * disabled. */
+struct apportable_dirs
+{
+	apportable_sv prefix, exec_prefix;
+	apportable_sv bindir, sbindir, libexecdir;
+	apportable_sv sysconfdir, sharedstatedir, localstatedir, runstatedir;
+	apportable_sv libdir, includedir;
+	apportable_sv datarootdir, datadir, localedir, mandir, docdir;
+};
+const struct apportable_dirs * apportable_dirs (apportable a);
+
+/* Options for whereis on this state, returns the previous ones.
+ * APPORTABLE_WHEREIS_INDEX lists each absolute search path directory once
+ * and looks names up in that listing, re-reading a directory when its
+ * mtime changes (checked at most every APPORTABLE_PATHINDEX_TTL ms).
+ * APPORTABLE_WHEREIS_DIRFD keeps up to 64 of those directories open and
+ * tests candidates relative to them.  Neither is available on Windows,
+ * where the flags have no effect.
+ * APPORTABLE_WHEREIS_URING (Linux) submits the candidates of whereis to
+ * io_uring as one batch, for slow filesystems; it takes precedence over
+ * DIRFD, and whereis probes one by one where io_uring is not usable. */
+#define APPORTABLE_WHEREIS_INDEX 1
+#define APPORTABLE_WHEREIS_DIRFD 2
+#define APPORTABLE_WHEREIS_URING 4
+int apportable_whereis_flags (apportable a, int flags);
+
+/* whereis for n names at once, walking the search path a single time.
+ * out[i] receives what whereis would return for bins[i] (NULL if out of
+ * memory); returns how many were found in a directory. */
+size_t apportable_whereis_many (apportable a, const char * searchpath, const char ** bins, size_t n, char ** out, int execonly);
+
+/* Templates, parsed once and expanded any number of times.  Tokens, also
+ * in the ${NAME} form: $ORIGIN, the directory of library_path (of the
+ * program if NULL); $LIB, APPORTABLE_LIB; $PLATFORM, the processor type
+ * as ld.so has it; ${ENV:NAME}, the environment variable NAME, empty if
+ * unset.  Anything else, $ included, is copied as is.  Unlike ld.so's,
+ * $LIB is decided at build time, not asked of the system: lib/<triplet>
+ * if built with APPORTABLE_MULTIARCH set to the multiarch triplet, else
+ * lib64 on 64-bit Linux and lib elsewhere.  Packagers whose layout
+ * differs define APPORTABLE_LIB. */
+struct apportable_tmpl * apportable_template_compile (apportable a, const char * template);
+char * apportable_template_expand (apportable a, const struct apportable_tmpl * t, const char * library_path);
+void apportable_template_free (apportable a, struct apportable_tmpl * t);
+
+/* template resolved against the program, on the global state: the same
+ * string is returned on every call for a template, or the template itself
+ * if it cannot be resolved.  Meant to stand in for a string literal. */
+const char * apportable_template (const char * template);
+
+/* Built with APPORTABLE_TRACE, the slow phases inside the library (lookups
+ * of the program, walks of the loaded objects, iconv, access() in whereis)
+ * are timed into per-thread rings.  Drains them into a Chrome trace (JSON,
+ * for chrome://tracing or Perfetto) at path; returns the number of events
+ * written, or -1 if the file could not be written or built without it. */
+long apportable_trace_write (const char * path);
+
+/* The _into variants write their result to a caller-owned buffer of cap
+ * elements and return it, or NULL if it is too small.  *needed (if not
+ * NULL) receives the exact size required, terminator included; it is 0
+ * where the allocating variant would have returned NULL. */
+char * apportable_wutf8_into (apportable a, const wchar_t * s, char * buf, size_t cap, size_t * needed);
+wchar_t * apportable_uwchar_t_into (apportable a, const char * s, wchar_t * buf, size_t cap, size_t * needed);
+char * apportable_ugetenv_into (apportable a, char * var, char * buf, size_t cap, size_t * needed);
+char * apportable_wugetenv_into (apportable a, wchar_t * wvar, char * buf, size_t cap, size_t * needed);
+char * apportable_whereis_into (apportable a, const char * searchpath, const char * bin, int execonly, char * buf, size_t cap, size_t * needed);
+char * apportable_progfile_into (apportable a, const char * library_name, char * buf, size_t cap, size_t * needed);
+char * apportable_progfile_for_address_into (apportable a, const void * addr, char * buf, size_t cap, size_t * needed);
+char * apportable_pathexp_into (apportable a, const char * template, const char * library_path, char * buf, size_t cap, size_t * needed);
+char * apportable_template_expand_into (apportable a, const struct apportable_tmpl * t, const char * library_path, char * buf, size_t cap, size_t * needed);
+
+/* The _sv variants take strings by pointer and length, unterminated if
+ * need be (slices of a larger buffer, say), and return the result with its
+ * length: allocated as for the others, p NULL where they return NULL.
+ * A NULL searchpath is empty; a NULL template or library_path is as NULL
+ * for the plain variants.  A bin, library_name or env name holding a NUL
+ * has no result. */
+apportable_sv apportable_whereis_sv (apportable a, apportable_sv searchpath, apportable_sv bin, int execonly);
+apportable_sv apportable_progfile_sv (apportable a, apportable_sv library_name);
+apportable_sv apportable_pathexp_sv (apportable a, apportable_sv template, apportable_sv library_path);
+struct apportable_tmpl * apportable_template_compile_sv (apportable a, apportable_sv template);
+apportable_sv apportable_template_expand_sv (apportable a, const struct apportable_tmpl * t, apportable_sv library_path);
+apportable_sv apportable_env_sv (apportable a, apportable_sv name);
+
 
 #endif /*APPORTABLE_H*/
@@ -0,0 +1,442 @@
+/* apportable_bench.c - Microbenchmarks for apportable
+ *
+ * Copyright (C) 2018 Claudio Luck
+ *
+ * This file is part of apportable.
+ *
+ * This file is free software; you can redistribute it and/or modify
+ * it under the terms of either
+ *
+ *   - the GNU Lesser General Public License as published by the Free
+ *     Software Foundation; either version 3 of the License, or (at
+ *     your option) any later version.
+ *
+ * or
+ *
+ *   - the GNU General Public License as published by the Free
+ *     Software Foundation; either version 2 of the License, or (at
+ *     your option) any later version.
+ *
+ * or both in parallel, as here.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, see <https://www.gnu.org/licenses/>.
+ */
+
+#if defined __linux__
+# define _GNU_SOURCE   /* RTLD_NEXT and dl_iterate_phdr */
+#elif defined __APPLE__
+# define _DARWIN_C_SOURCE
+#else
+# define _POSIX_C_SOURCE 200809L
+#endif
+/* the wrappers below must be the plain entry points */
+#undef _FORTIFY_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <wchar.h>
+#include <time.h>
+
+#if !defined _WIN32
+# define BENCH_SYSCALLS
+# include <stdarg.h>
+# include <fcntl.h>
+# include <dirent.h>
+# include <dlfcn.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/utsname.h>
+#endif
+#if defined __linux__
+# include <link.h>
+#endif
+
+#include "apportable.h"
+
+
+static const char * ascii_s = "/usr/local/share/apportable/etc/apportable.conf";
+static const wchar_t * ascii_w = L"/usr/local/share/apportable/etc/apportable.conf";
+static const char * mb_s = "/home/\xc3\xa4\xce\xb2\xc2\xa9/\xe2\x98\x83\xe2\x98\x82/etc/apportable.conf";
+static const wchar_t * mb_w = L"/home/\x00e4\x03b2\x00a9/\x2603\x2602/etc/apportable.conf";
+
+
+static const char * tools[8] = {"sh", "env", "ls", "cat", "apportable-a", "apportable-b", "apportable-c", "apportable-d"};
+static const char * tmpl = "$ORIGIN/../etc/apportable.conf";
+static const char * searchpath = "/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin"
+    ":/usr/games:/usr/local/games:/snap/bin:/opt/bin:/usr/lib/jvm/bin:/usr/libexec";
+static const char * short_searchpath = "/usr/bin:/bin";
+
+/* where the cases returning a view put it, read or not */
+static const char * volatile sink;
+
+
+/* Counters.  Allocations are the library's, made through the state's
+ * _calloc.  System calls are those it makes through the libc entry points
+ * below, which it calls instead of libc's being linked into this program;
+ * libc's own (inside realpath, iconv, malloc) are not seen, and realpath
+ * counts as one. */
+static unsigned long allocs, syscalls;
+
+static void * counting_calloc (size_t count, size_t size)
+{
+    allocs++;
+    return calloc(count, size);
+}
+
+#if defined BENCH_SYSCALLS
+
+#define NEXT(name, ret, params) \
+    static ret (*next) params; \
+    if (!next) \
+        next = (ret (*) params) dlsym(RTLD_NEXT, name); \
+    syscalls++
+
+int access (const char * path, int mode)
+{
+    NEXT("access", int, (const char *, int));
+    return next(path, mode);
+}
+
+int faccessat (int dirfd, const char * path, int mode, int flags)
+{
+    NEXT("faccessat", int, (int, const char *, int, int));
+    return next(dirfd, path, mode, flags);
+}
+
+int stat (const char * path, struct stat * buf)
+{
+    NEXT("stat", int, (const char *, struct stat *));
+    return next(path, buf);
+}
+
+int fstat (int fd, struct stat * buf)
+{
+    NEXT("fstat", int, (int, struct stat *));
+    return next(fd, buf);
+}
+
+int open (const char * path, int flags, ...)
+{
+    va_list ap;
+    int mode;
+
+    NEXT("open", int, (const char *, int, ...));
+    va_start(ap, flags);
+    mode = flags & O_CREAT ? va_arg(ap, int) : 0;
+    va_end(ap);
+    return next(path, flags, mode);
+}
+
+int close (int fd)
+{
+    NEXT("close", int, (int));
+    return next(fd);
+}
+
+DIR * opendir (const char * path)
+{
+    NEXT("opendir", DIR *, (const char *));
+    return next(path);
+}
+
+struct dirent * readdir (DIR * dir)
+{
+    NEXT("readdir", struct dirent *, (DIR *));
+    return next(dir);
+}
+
+int closedir (DIR * dir)
+{
+    NEXT("closedir", int, (DIR *));
+    return next(dir);
+}
+
+ssize_t readlink (const char * path, char * buf, size_t size)
+{
+    NEXT("readlink", ssize_t, (const char *, char *, size_t));
+    return next(path, buf, size);
+}
+
+char * realpath (const char * path, char * resolved)
+{
+    NEXT("realpath", char *, (const char *, char *));
+    return next(path, resolved);
+}
+
+void * mmap (void * addr, size_t size, int prot, int flags, int fd, off_t offset)
+{
+    NEXT("mmap", void *, (void *, size_t, int, int, int, off_t));
+    return next(addr, size, prot, flags, fd, offset);
+}
+
+int munmap (void * addr, size_t size)
+{
+    NEXT("munmap", int, (void *, size_t));
+    return next(addr, size);
+}
+
+int uname (struct utsname * buf)
+{
+    NEXT("uname", int, (struct utsname *));
+    return next(buf);
+}
+
+#if defined __linux__
+/* io_uring; as libc does, pass on six arguments whatever the call */
+long syscall (long number, ...)
+{
+    va_list ap;
+    long arg[6];
+    int i;
+
+    NEXT("syscall", long, (long, ...));
+    va_start(ap, number);
+    for (i = 0; i < 6; i++)
+        arg[i] = va_arg(ap, long);
+    va_end(ap);
+    return next(number, arg[0], arg[1], arg[2], arg[3], arg[4], arg[5]);
+}
+#endif
+
+#endif /*BENCH_SYSCALLS*/
+
+
+static void whereis_each (apportable a)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        free(a->whereis(a, searchpath, tools[i], 1));
+}
+
+static void whereis_many (apportable a)
+{
+    char * out[8];
+    int i;
+
+    a->whereis_many(a, searchpath, tools, 8, out, 1);
+    for (i = 0; i < 8; i++)
+        free(out[i]);
+}
+
+
+/* resolve in batches of 256, dropped at once */
+static void pathexp_arena (apportable a)
+{
+    static int batch = 0;
+
+    a->pathexp(a, tmpl, ascii_s);
+    if (++batch == 256) {
+        apportable_arena_reset(a);
+        batch = 0;
+    }
+}
+
+
+static double now_ns (void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+
+struct result
+{
+    const char * name;
+    long iters;
+    double ns, allocs, syscalls;   /* per op */
+};
+
+static struct result results[128];
+static int nresults;
+
+static void record (const char * name, long iters, double ns, unsigned long nallocs, unsigned long nsyscalls)
+{
+    struct result * r;
+
+    printf("%-24s %10.1f ns/op %8.2f allocs/op", name, ns / iters, (double) nallocs / iters);
+#if defined BENCH_SYSCALLS
+    printf(" %8.2f syscalls/op", (double) nsyscalls / iters);
+#endif
+    printf("\n");
+    if (nresults == sizeof(results) / sizeof(*results))
+        return;
+    r = &results[nresults++];
+    r->name = name;
+    r->iters = iters;
+    r->ns = ns / iters;
+    r->allocs = (double) nallocs / iters;
+    r->syscalls = (double) nsyscalls / iters;
+}
+
+/* the names are plain ASCII, nothing to escape */
+static int write_json (const char * path)
+{
+    FILE * f;
+    int i;
+
+    if (!(f = fopen(path, "w")))
+        return -1;
+    fprintf(f, "{\n  \"benchmarks\": [\n");
+    for (i = 0; i < nresults; i++) {
+        fprintf(f, "    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, ",
+                results[i].name, results[i].iters, results[i].ns, results[i].allocs);
+#if defined BENCH_SYSCALLS
+        fprintf(f, "\"syscalls_per_op\": %.2f}", results[i].syscalls);
+#else
+        fprintf(f, "\"syscalls_per_op\": null}");
+#endif
+        fprintf(f, "%s\n", i + 1 < nresults ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f);
+}
+
+
+#define BENCH(name, iters, stmt) do { \
+        double _t0, _t1; \
+        unsigned long _allocs, _syscalls; \
+        long _i; \
+        for (_i = 0; _i < (iters) / 10; _i++) { stmt; } \
+        _allocs = allocs; \
+        _syscalls = syscalls; \
+        _t0 = now_ns(); \
+        for (_i = 0; _i < (iters); _i++) { stmt; } \
+        _t1 = now_ns(); \
+        record((name), (iters), _t1 - _t0, allocs - _allocs, syscalls - _syscalls); \
+    } while (0)
+
+
+#if defined __linux__
+/* basenames of the first and last library loaded */
+static int libs_cb (struct dl_phdr_info * info, size_t size, void * data)
+{
+    const char ** libs = data;
+    const char * name;
+
+    (void) size;
+    if (!info->dlpi_name || !*info->dlpi_name || strstr(info->dlpi_name, "linux-vdso"))
+        return 0;
+    name = strrchr(info->dlpi_name, '/');
+    name = name ? name + 1 : info->dlpi_name;
+    if (!libs[0])
+        libs[0] = name;
+    libs[1] = name;
+    return 0;
+}
+#endif
+
+
+int main (int argc, char ** argv)
+{
+    apportable_t st = {0};
+    apportable a = &st;
+    long n = 200000;
+    char * long_s;
+    struct apportable_tmpl * compiled;
+    apportable_sv tmpl_sv, lib_sv;
+    wchar_t * long_w;
+    const char * json = NULL;
+    const char * libs[2] = {NULL, NULL};
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--json") && i + 1 < argc)
+            json = argv[++i];
+        else
+            n = atol(argv[i]);
+    }
+    apportable_init(a, 1);
+    a->_calloc = counting_calloc;
+#if defined _WIN32
+    _putenv_s("APPORTABLE_BENCH", mb_s);
+#else
+    setenv("APPORTABLE_BENCH", mb_s, 1);
+#endif
+#if defined __linux__
+    dl_iterate_phdr(&libs_cb, libs);
+#endif
+
+    long_s = calloc(1, 4096 + 1);
+    long_w = calloc(sizeof(wchar_t), 4096 + 1);
+    for (i = 0; i < 4096; i++)
+        long_w[i] = long_s[i] = ascii_s[i % strlen(ascii_s)];
+
+    BENCH("wutf8/ascii", n, free(a->wutf8(a, ascii_w)));
+    BENCH("wutf8/multibyte", n, free(a->wutf8(a, mb_w)));
+    BENCH("uwchar_t/ascii", n, free(a->uwchar_t(a, ascii_s)));
+    BENCH("uwchar_t/multibyte", n, free(a->uwchar_t(a, mb_s)));
+    BENCH("wutf8/ascii-4k", n / 10, free(a->wutf8(a, long_w)));
+    BENCH("uwchar_t/ascii-4k", n / 10, free(a->uwchar_t(a, long_s)));
+    BENCH("wugetenv", n, free(a->wugetenv(a, L"PATH")));
+    BENCH("ugetenv", n, free(a->ugetenv(a, "HOME")));
+    BENCH("ugetenv/multibyte", n, free(a->ugetenv(a, "APPORTABLE_BENCH")));
+    BENCH("env", n, sink = apportable_env(a, "HOME").p);
+    apportable_env_refresh(a);
+    BENCH("ugetenv/snapshot", n, free(a->ugetenv(a, "HOME")));
+    BENCH("wugetenv/snapshot", n, free(a->wugetenv(a, L"PATH")));
+    BENCH("env/snapshot", n, sink = apportable_env(a, "HOME").p);
+    BENCH("strndup/ascii", n, free(a->_strndup(a, ascii_s, 0)));
+    BENCH("strndup/multibyte", n, free(a->_strndup(a, mb_s, 10)));
+    BENCH("strndup/ascii-4k", n / 10, free(a->_strndup(a, long_s, 4000)));
+    BENCH("wcsndup/ascii", n, free(a->_wcsndup(a, ascii_w, 0)));
+    BENCH("wcsndup/multibyte", n, free(a->_wcsndup(a, mb_w, 10)));
+
+    BENCH("progfile/main", n, free(a->progfile(a, NULL)));
+    BENCH("progfile/libc", n, free(a->progfile(a, "libc.so.6")));
+    if (libs[0]) {
+        BENCH("progfile/first-lib", n, free(a->progfile(a, libs[0])));
+        BENCH("progfile/last-lib", n, free(a->progfile(a, libs[1])));
+    }
+    BENCH("progfile/address", n, free(a->progfile_for_address(a, (const void *) &printf)));
+    BENCH("exepath", n, sink = apportable_exepath(a, NULL));
+    BENCH("whereis/miss", n / 10, free(a->whereis(a, searchpath, "apportable-none", 1)));
+    BENCH("whereis/miss-short", n / 10, free(a->whereis(a, short_searchpath, "apportable-none", 1)));
+    BENCH("whereis/hit-short", n / 10, free(a->whereis(a, short_searchpath, "sh", 1)));
+    apportable_whereis_flags(a, APPORTABLE_WHEREIS_INDEX);
+    BENCH("whereis/miss-index", n / 10, free(a->whereis(a, searchpath, "apportable-none", 1)));
+    BENCH("whereis/hit-index", n / 10, free(a->whereis(a, searchpath, "sh", 1)));
+    apportable_whereis_flags(a, APPORTABLE_WHEREIS_DIRFD);
+    BENCH("whereis/miss-dirfd", n / 10, free(a->whereis(a, searchpath, "apportable-none", 1)));
+    BENCH("whereis/hit-dirfd", n / 10, free(a->whereis(a, searchpath, "sh", 1)));
+    apportable_whereis_flags(a, APPORTABLE_WHEREIS_URING);
+    BENCH("whereis/miss-uring", n / 10, free(a->whereis(a, searchpath, "apportable-none", 1)));
+    BENCH("whereis/hit-uring", n / 10, free(a->whereis(a, searchpath, "sh", 1)));
+    apportable_whereis_flags(a, 0);
+    BENCH("whereis/hit", n / 10, free(a->whereis(a, searchpath, "sh", 1)));
+    BENCH("whereis/8-each", n / 100, whereis_each(a));
+    BENCH("whereis/8-many", n / 100, whereis_many(a));
+    BENCH("pathexp", n, free(a->pathexp(a, tmpl, ascii_s)));
+    BENCH("pathexp/multibyte", n, free(a->pathexp(a, tmpl, mb_s)));
+    tmpl_sv.p = tmpl;
+    tmpl_sv.n = strlen(tmpl);
+    lib_sv.p = ascii_s;
+    lib_sv.n = strlen(ascii_s);
+    BENCH("pathexp/sv", n, free((void *) apportable_pathexp_sv(a, tmpl_sv, lib_sv).p));
+    compiled = apportable_template_compile(a, tmpl);
+    BENCH("template_expand", n, free(a->template_expand(a, compiled, ascii_s)));
+    BENCH("dirs/sysconfdir", n, sink = apportable_dirs(a)->sysconfdir.p);
+    apportable_template_free(a, compiled);
+    BENCH("template/interned", n, sink = apportable_template(tmpl));
+    apportable_arena_begin(a, 0);
+    BENCH("pathexp/arena", n, pathexp_arena(a));
+    apportable_arena_end(a);
+
+    free(long_s);
+    free(long_w);
+    apportable_fini(a);
+    if (json && write_json(json) != 0) {
+        perror(json);
+        return 1;
+    }
+    return 0;
+}
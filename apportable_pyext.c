@@ -8,6 +8,11 @@
 #include "apportable.h"
 
 #include <stdio.h>
+#if defined _WIN32
+# include <windows.h>
+#else
+# include <unistd.h>
+#endif
 
 // #include <iconv.h>
 
@@ -15,6 +20,7 @@
 struct module_state {
     PyObject *error;
     apportable_t apportable;
+    apportable_t snapshot;   /* env and env_refresh, kept apart from the others */
 };
 
 #if PY_VERSION_HEX >= 0x03000000
@@ -83,26 +89,149 @@ wchar_t * _appoext_pyobywstr (PyObject * self, PyObject * str)
 }
 
 
-/* take a Python Unicode string object, and get a UTF-8 copy */
-char * _appoext_pyobyutf8 (PyObject * self, PyObject * str)
+#if PY_VERSION_HEX < 0x03030000
+/* Before 3.3 a str keeps no UTF-8 of its own: the bytes made for one go
+ * to a list in the thread state, which the METH_VARARGS shim sets up and
+ * releases around each call */
+# define APPOEXT_KEEP "_apportable_keep"
+#endif
+
+/* take a Python Unicode string object, and get its UTF-8, borrowed and
+ * terminated: from 3.3 the object keeps it for as long as it lives, before
+ * that the call in progress does */
+const char * _appoext_pyobyutf8 (PyObject * str, Py_ssize_t * len)
 {
-	PyObject * bytes;
-	char * s, * ret;
-	size_t s_l;
+	const char * s;
+#if PY_VERSION_HEX < 0x03030000
+	PyObject * bytes, * dict, * keep;
+#endif
 
+	if (!PyUnicode_Check(str)) {
+		PyErr_Format(PyExc_TypeError, "expected str, not %.50s", Py_TYPE(str)->tp_name);
+		return NULL;
+	}
+#if PY_VERSION_HEX >= 0x03030000
+	if (!(s = PyUnicode_AsUTF8AndSize(str, len)))
+		return NULL;
+#else
 	if (!(bytes = PyUnicode_AsUTF8String(str)))
 		return NULL;
-	if (!(s = PyBytes_AsString(bytes))) {
+	dict = PyThreadState_GetDict();
+	keep = dict ? PyDict_GetItemString(dict, APPOEXT_KEEP) : NULL;
+	if (!keep || PyList_Append(keep, bytes) < 0) {
+		Py_DECREF(bytes);
+		if (!PyErr_Occurred())
+			PyErr_SetString(PyExc_SystemError, "no call to keep the UTF-8 for");
 		return NULL;
 	}
-	s_l = strlen(s);
-	if (!(ret = PyMem_Malloc(s_l + 1)))
+	Py_DECREF(bytes);   /* the list has it */
+	s = PyBytes_AS_STRING(bytes);
+	*len = PyBytes_GET_SIZE(bytes);
+#endif
+	/* as PyArg_ParseTuple's "s": the C API would stop at a NUL */
+	if (strlen(s) != (size_t) *len) {
+		PyErr_SetString(PyExc_ValueError, "embedded null character");
 		return NULL;
-	memcpy(ret, s, s_l);
-	ret[s_l] = 0;
-	return ret;
+	}
+	return s;
+}
+
+/* the same as a string view, None giving {NULL, 0} with none_ok; -1 on
+ * error */
+static int
+_appoext_pyobysv (PyObject * str, apportable_sv * sv, int none_ok)
+{
+	Py_ssize_t len;
+
+	sv->n = 0;
+	if (none_ok && str == Py_None) {
+		sv->p = NULL;
+		return 0;
+	}
+	if (!(sv->p = _appoext_pyobyutf8(str, &len)))
+		return -1;
+	sv->n = len;
+	return 0;
+}
+
+/* an apportable_sv result -> str, or None for {NULL, 0} */
+static PyObject *
+_appoext_sv_result (PyObject * self, apportable_sv ret)
+{
+	struct module_state *st;
+	PyObject * pyres;
+
+	if (!ret.p) {
+		Py_RETURN_NONE;
+	}
+	st = GETSTATE(self);
+	pyres = PyUnicode_FromStringAndSize(ret.p, ret.n);
+	apportable_free(&(st->apportable), (void *) ret.p);
+	return pyres;
+}
+
+
+/* Arguments come as an array, METH_FASTCALL, so there is no tuple to build
+ * and take apart per call.  Python before 3.7 has only METH_VARARGS; a shim
+ * there passes the tuple's own items on, see APPOEXT_METHOD. */
+static int
+_appoext_nargs (const char * name, Py_ssize_t nargs, Py_ssize_t min, Py_ssize_t max)
+{
+	if (nargs >= min && nargs <= max)
+		return 0;
+	PyErr_Format(PyExc_TypeError, "%s() takes %s %zd argument%s (%zd given)", name,
+			min == max ? "exactly" : nargs < min ? "at least" : "at most",
+			nargs < min ? min : max, (nargs < min ? min : max) == 1 ? "" : "s", nargs);
+	return -1;
+}
+
+/* as "n" */
+static int
+_appoext_ssize (PyObject * o, Py_ssize_t * v)
+{
+	*v = PyNumber_AsSsize_t(o, PyExc_OverflowError);
+	return *v == -1 && PyErr_Occurred() ? -1 : 0;
+}
+
+/* as "i" */
+static int
+_appoext_int (PyObject * o, int * v)
+{
+	Py_ssize_t n;
+
+	if (_appoext_ssize(o, &n) < 0)
+		return -1;
+	if (n < INT_MIN || n > INT_MAX) {
+		PyErr_SetString(PyExc_OverflowError, "signed integer is out of range");
+		return -1;
+	}
+	*v = (int) n;
+	return 0;
+}
+
+/* as "y*", or "z*" with none_ok: buf->obj stays NULL for None */
+static int
+_appoext_buffer (PyObject * o, Py_buffer * buf, int none_ok)
+{
+	buf->obj = NULL;
+	buf->buf = NULL;
+	buf->len = 0;
+	if (none_ok && o == Py_None)
+		return 0;
+	return PyObject_GetBuffer(o, buf, PyBUF_SIMPLE);
 }
 
+static apportable_sv
+_appoext_buffer_sv (const Py_buffer * buf)
+{
+	apportable_sv sv;
+
+	sv.p = buf->buf;
+	sv.n = buf->len;
+	return sv;
+}
+
+
 int _selftest (PyObject * self)
 {
 	struct module_state *st;
@@ -113,14 +242,19 @@ int _selftest (PyObject * self)
 	// wchar_t * x = "❤"
 	// "\xc3\xa4\xce\xb2\xc2\xa9\xe2\x98\x83\xe2\x98\x82"; /* UTF-16 */
 	char * tt = "\xc3\xa4\xce\xb2\xe2\x9d\xa4\xc2\xa9\xe2\x98\x83\xe2\x98\x82";
- 	char * r;
+	const char * r;
+	Py_ssize_t r_l;
 	wchar_t * wr;
 	char * r2;
 	PyObject * o = PyUnicode_FromString(tt);
 
 	
-	r = _appoext_pyobyutf8(self, o);
-	printf("utf-8  : %zu '%s'\n", strlen(r), r);
+	if (!(r = _appoext_pyobyutf8(o, &r_l))) {
+		PyErr_Clear();   /* before 3.3, there is no call to keep it */
+		r = "";
+		r_l = 0;
+	}
+	printf("utf-8  : %zd '%s'\n", r_l, r);
 	
 	for (int i = 0; i < 5; i++) {
 
@@ -146,23 +280,23 @@ appoext_selftest (PyObject * self, PyObject * args)
 
 
 static PyObject *
-appoext_strndup (PyObject * self, PyObject * args)
+appoext_strndup (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
 {
-	PyObject * str;
-	Py_ssize_t size;
+	Py_ssize_t s_l, size;
 	struct module_state *st;
-	char * s, * ret;
+	const char * s;
+	char * ret;
 	PyObject * pyres;
 
- 	if (!PyArg_ParseTuple(args, "Un", &str, &size)) {
-  		return NULL;
+	if (_appoext_nargs("strndup", nargs, 2, 2) < 0 || !(s = _appoext_pyobyutf8(args[0], &s_l))
+			|| _appoext_ssize(args[1], &size) < 0) {
+		return NULL;
 	}
 	st = GETSTATE(self);
-	s = _appoext_pyobyutf8(self, str);
 	ret = st->apportable._strndup(&(st->apportable), s, size);
 
 	pyres = PyUnicode_FromString(ret);
-	free(ret);
+	apportable_free(&(st->apportable), ret);
 	return pyres;
 }
 
@@ -170,210 +304,1027 @@ appoext_strndup (PyObject * self, PyObject * args)
 
 
 static PyObject *
-appoext_wcsndup (PyObject * self, PyObject * args)
+appoext_wcsndup (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
 {
-	PyObject * str;
 	Py_ssize_t size;
 	wchar_t * wstr;
 	struct module_state *st;
 	char * ret;
 	PyObject * pyres;
 
- 	if (!PyArg_ParseTuple(args, "Un", &str, &size)) {
-  		return NULL;
+	if (_appoext_nargs("wcsndup", nargs, 2, 2) < 0 || _appoext_ssize(args[1], &size) < 0) {
+		return NULL;
+	}
+	if (!PyUnicode_Check(args[0])) {
+		PyErr_SetString(PyExc_TypeError, "wcsndup() argument 1 must be str");
+		return NULL;
 	}
 	st = GETSTATE(self);
-	wstr = _appoext_pyobywstr(self, str);
+	if (!(wstr = _appoext_pyobywstr(self, args[0])))
+		return NULL;
 	ret = (char *) st->apportable._wcsndup(&(st->apportable), wstr, size);
 	PyMem_Free(wstr);
 
 	pyres = PyUnicode_FromWideChar((wchar_t *) ret, wcslen((wchar_t *) ret));
-	free(ret);
+	apportable_free(&(st->apportable), ret);
 	return pyres;
 }
 
 
 static PyObject *
-appoext_wutf8 (PyObject * self, PyObject * args)
+appoext_wutf8 (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
 {
-	PyObject * str;
 	wchar_t * wstr;
 	struct module_state *st;
 	char * ret;
 	PyObject * pyres;
 
- 	if (!PyArg_ParseTuple(args, "U", &str)) {
-  		return NULL;
+	if (_appoext_nargs("wutf8", nargs, 1, 1) < 0) {
+		return NULL;
+	}
+	if (!PyUnicode_Check(args[0])) {
+		PyErr_SetString(PyExc_TypeError, "wutf8() argument must be str");
+		return NULL;
 	}
 	st = GETSTATE(self);
-	wstr = _appoext_pyobywstr(self, str);
+	if (!(wstr = _appoext_pyobywstr(self, args[0])))
+		return NULL;
 	ret = st->apportable.wutf8(&(st->apportable), wstr);
+	PyMem_Free(wstr);
 
 	pyres = PyUnicode_FromString(ret);
-	free(ret);
+	apportable_free(&(st->apportable), ret);
 	return pyres;
 }
 
 
 static PyObject *
-appoext_uwchar_t (PyObject * self, PyObject * args)
+appoext_uwchar_t (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
 {
-	PyObject * str;
-	char * cstr;
+	const char * cstr;
+	Py_ssize_t cstr_l;
 	struct module_state *st;
 	wchar_t * ret;
 	PyObject * pyres;
 
- 	if (!PyArg_ParseTuple(args, "U", &str)) {
-  		return NULL;
+	if (_appoext_nargs("uwchar_t", nargs, 1, 1) < 0 || !(cstr = _appoext_pyobyutf8(args[0], &cstr_l))) {
+		return NULL;
 	}
 	st = GETSTATE(self);
-	cstr = _appoext_pyobyutf8(self, str);
 	ret = st->apportable.uwchar_t(&(st->apportable), cstr);
 
 	pyres = PyUnicode_FromWideChar((wchar_t *) ret, wcslen((wchar_t *) ret));
-	free(ret);
+	apportable_free(&(st->apportable), ret);
 	return pyres;
 }
 
 
 
+/* whereis(searchpath, bin, execonly) -> str, bin itself if in no directory */
 static PyObject *
-appoext_whereis (PyObject * self, PyObject * args)
+appoext_whereis (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
 {
 	struct module_state *st;
-	PyObject * osp, * obin;
-	char * searchpath, * bin;
+	apportable_sv searchpath, bin;
+	int execonly;
+
+	if (_appoext_nargs("whereis", nargs, 3, 3) < 0
+			|| _appoext_pyobysv(args[0], &searchpath, 0) < 0 || _appoext_pyobysv(args[1], &bin, 0) < 0
+			|| _appoext_int(args[2], &execonly) < 0) {
+		return NULL;
+	}
+	st = GETSTATE(self);
+	/* the strings are the arguments', which outlive the call */
+	Py_BEGIN_ALLOW_THREADS
+	searchpath = apportable_whereis_sv(&(st->apportable), searchpath, bin, execonly);
+	Py_END_ALLOW_THREADS
+	return _appoext_sv_result(self, searchpath);
+}
+
+
+/* Batches: whereis_many, pathexp_many and progfile_many take their
+ * arguments apart once with the GIL held, and resolve the items without
+ * it.  The calling thread and up to APPOEXT_POOL pool threads each claim
+ * a slice at a time.  One batch has the pool at once; a batch started
+ * meanwhile runs in its own thread only. */
+#define APPOEXT_POOL 3   /* threads besides the caller, at most */
+
+struct appoext_batch {
+	apportable a;
+	void (*run) (struct appoext_batch *, Py_ssize_t, Py_ssize_t);
+	const char * arg;   /* the search path or library path */
 	int execonly;
+	PyObject * items;   /* a tuple, owning the strings in points into */
+	const char ** in;
+	char ** out;
+	Py_ssize_t n, next, slice;
+	int helpers, done;
+};
+
+static struct appoext_pool {
+	PyThread_type_lock busy;   /* held by the batch that has the pool */
+	PyThread_type_lock lock;   /* the batch's next and done */
+	PyThread_type_lock finished;   /* held until the last helper is done */
+	PyThread_type_lock go[APPOEXT_POOL];   /* released to hand a thread the batch */
+	int sized, size, threads;
+	struct appoext_batch * batch;
+#if !defined _WIN32
+	pid_t pid;   /* a forked child has none of the threads */
+#endif
+} _appoext_pool;
+
+static void
+_appoext_batch_work (struct appoext_batch * b)
+{
+	Py_ssize_t lo, hi;
+
+	if (!b->helpers) {
+		b->run(b, 0, b->n);
+		return;
+	}
+	for (;;) {
+		PyThread_acquire_lock(_appoext_pool.lock, 1);
+		lo = b->next;
+		hi = b->next = b->n - lo > b->slice ? lo + b->slice : b->n;
+		PyThread_release_lock(_appoext_pool.lock);
+		if (lo >= hi)
+			return;
+		b->run(b, lo, hi);
+	}
+}
+
+static void
+_appoext_pool_run (void * arg)
+{
+	PyThread_type_lock go = arg;
+	struct appoext_batch * b;
+	int last;
+
+	for (;;) {
+		PyThread_acquire_lock(go, 1);
+		b = _appoext_pool.batch;
+		_appoext_batch_work(b);
+		PyThread_acquire_lock(_appoext_pool.lock, 1);
+		last = ++b->done == b->helpers;
+		PyThread_release_lock(_appoext_pool.lock);
+		if (last)
+			PyThread_release_lock(_appoext_pool.finished);
+	}
+}
+
+/* the processors online, 1 if unknown */
+static int
+_appoext_ncpu (void)
+{
+#if defined _WIN32
+	SYSTEM_INFO si;
+
+	GetSystemInfo(&si);
+	return (int) si.dwNumberOfProcessors;
+#elif defined _SC_NPROCESSORS_ONLN
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+#else
+	return 1;
+#endif
+}
+
+/* starts what is missing of the pool, with the GIL held: a thread for
+ * each processor but the caller's, up to APPOEXT_POOL; the threads there
+ * are */
+static int
+_appoext_pool_start (void)
+{
+	struct appoext_pool * pool = &_appoext_pool;
+	PyThread_type_lock go;
+
+#if !defined _WIN32
+	if (pool->pid != getpid()) {
+		/* the parent's locks may be held for good */
+		memset(pool, 0, sizeof(*pool));
+		pool->pid = getpid();
+	}
+#endif
+	if (!pool->sized) {
+		pool->sized = 1;
+		pool->size = _appoext_ncpu() - 1 < APPOEXT_POOL ? _appoext_ncpu() - 1 : APPOEXT_POOL;
+	}
+	if (pool->size < 1)
+		return 0;
+	if (!pool->busy)
+		pool->busy = PyThread_allocate_lock();
+	if (!pool->lock)
+		pool->lock = PyThread_allocate_lock();
+	if (!pool->finished)
+		pool->finished = PyThread_allocate_lock();
+	if (!pool->busy || !pool->lock || !pool->finished)
+		return 0;
+	while (pool->threads < pool->size) {
+		if (!(go = PyThread_allocate_lock()))
+			break;
+		PyThread_acquire_lock(go, 1);   /* for the thread to wait on */
+		if (PyThread_start_new_thread(_appoext_pool_run, go) == (unsigned long) -1) {
+			PyThread_release_lock(go);
+			PyThread_free_lock(go);
+			break;
+		}
+		pool->go[pool->threads++] = go;
+	}
+	return pool->threads;
+}
+
+/* b->in from a sequence of str, or None too with none_ok, borrowed from
+ * the tuple b->items; -1 on error, with nothing left to release */
+static int
+_appoext_batch_init (struct appoext_batch * b, PyObject * self, PyObject * seq, int none_ok)
+{
+	struct module_state *st;
+	PyObject * item;
+	Py_ssize_t i, len;
+
+	st = GETSTATE(self);
+	b->a = &(st->apportable);
+	b->in = NULL;
+	b->out = NULL;
+	if (!(b->items = PySequence_Tuple(seq)))
+		return -1;
+	b->n = PyTuple_GET_SIZE(b->items);
+	b->in = PyMem_Malloc((b->n ? b->n : 1) * sizeof(*b->in));
+	b->out = PyMem_Malloc((b->n ? b->n : 1) * sizeof(*b->out));
+	if (!b->in || !b->out) {
+		PyErr_NoMemory();
+		goto fail;
+	}
+	for (i = 0; i < b->n; i++) {
+		b->out[i] = NULL;
+		item = PyTuple_GET_ITEM(b->items, i);
+		if (none_ok && item == Py_None)
+			b->in[i] = NULL;
+		else if (!(b->in[i] = _appoext_pyobyutf8(item, &len)))
+			goto fail;
+	}
+	return 0;
+fail:
+	PyMem_Free(b->in);
+	PyMem_Free(b->out);
+	Py_DECREF(b->items);
+	return -1;
+}
+
+/* runs b, items of grain at least to a thread, and gives the results as a
+ * list of str or None */
+static PyObject *
+_appoext_batch_run (struct appoext_batch * b, Py_ssize_t grain)
+{
+	struct appoext_pool * pool = &_appoext_pool;
+	PyObject * pyres, * item;
+	Py_ssize_t i;
+	int threads;
+
+	b->next = 0;
+	b->done = 0;
+	b->helpers = 0;
+	if (b->n >= 2 * grain && (threads = _appoext_pool_start()) && PyThread_acquire_lock(pool->busy, 0)) {
+		b->helpers = (int) (b->n / grain - 1 < threads ? b->n / grain - 1 : threads);
+		b->slice = (b->n + b->helpers) / (b->helpers + 1);
+		pool->batch = b;
+		PyThread_acquire_lock(pool->finished, 1);
+		for (i = 0; i < b->helpers; i++)
+			PyThread_release_lock(pool->go[i]);
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	_appoext_batch_work(b);
+	if (b->helpers) {
+		PyThread_acquire_lock(pool->finished, 1);
+		PyThread_release_lock(pool->finished);
+		PyThread_release_lock(pool->busy);
+	}
+	Py_END_ALLOW_THREADS
+
+	pyres = PyList_New(b->n);
+	for (i = 0; i < b->n; i++) {
+		if (pyres && b->out[i])
+			item = PyUnicode_FromString(b->out[i]);
+		else {
+			Py_INCREF(Py_None);
+			item = Py_None;
+		}
+		apportable_free(b->a, b->out[i]);
+		if (!item)
+			Py_CLEAR(pyres);
+		else if (pyres)
+			PyList_SET_ITEM(pyres, i, item);
+		else
+			Py_DECREF(item);
+	}
+	PyMem_Free(b->in);
+	PyMem_Free(b->out);
+	Py_DECREF(b->items);
+	return pyres;
+}
+
+
+static void
+_appoext_whereis_slice (struct appoext_batch * b, Py_ssize_t lo, Py_ssize_t hi)
+{
+	b->a->whereis_many(b->a, b->arg, b->in + lo, hi - lo, b->out + lo, b->execonly);
+}
+
+/* whereis_many(searchpath, [bin, ...], execonly) -> [path, ...] */
+static PyObject *
+appoext_whereis_many (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	struct appoext_batch b;
+	Py_ssize_t len;
+
+	if (_appoext_nargs("whereis_many", nargs, 3, 3) < 0 || !(b.arg = _appoext_pyobyutf8(args[0], &len))
+			|| _appoext_int(args[2], &b.execonly) < 0 || _appoext_batch_init(&b, self, args[1], 0) < 0) {
+		return NULL;
+	}
+	b.run = _appoext_whereis_slice;
+	/* a slice shares its directory probes */
+	return _appoext_batch_run(&b, 8);
+}
+
+
+static void
+_appoext_pathexp_slice (struct appoext_batch * b, Py_ssize_t lo, Py_ssize_t hi)
+{
+	for (; lo < hi; lo++)
+		b->out[lo] = b->a->pathexp(b->a, b->in[lo], b->arg);
+}
+
+/* pathexp_many([template, ...], library_path or None) -> [str or None, ...] */
+static PyObject *
+appoext_pathexp_many (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	struct appoext_batch b;
+	apportable_sv library_path;
+
+	if (_appoext_nargs("pathexp_many", nargs, 2, 2) < 0 || _appoext_pyobysv(args[1], &library_path, 1) < 0
+			|| _appoext_batch_init(&b, self, args[0], 0) < 0) {
+		return NULL;
+	}
+	b.arg = library_path.p;
+	b.run = _appoext_pathexp_slice;
+	/* string work only, worth a thread in the thousands */
+	return _appoext_batch_run(&b, 2048);
+}
+
+
+static void
+_appoext_progfile_slice (struct appoext_batch * b, Py_ssize_t lo, Py_ssize_t hi)
+{
+	for (; lo < hi; lo++)
+		b->out[lo] = b->a->progfile(b->a, b->in[lo]);
+}
+
+/* progfile_many([library_name or None, ...]) -> [str or None, ...] */
+static PyObject *
+appoext_progfile_many (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	struct appoext_batch b;
+
+	if (_appoext_nargs("progfile_many", nargs, 1, 1) < 0 || _appoext_batch_init(&b, self, args[0], 1) < 0) {
+		return NULL;
+	}
+	b.run = _appoext_progfile_slice;
+	return _appoext_batch_run(&b, 64);
+}
+
+
+/* whereis_flags(flags) -> previous flags */
+static PyObject *
+appoext_whereis_flags (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	struct module_state *st;
+	int flags;
+
+	if (_appoext_nargs("whereis_flags", nargs, 1, 1) < 0 || _appoext_int(args[0], &flags) < 0) {
+		return NULL;
+	}
+	st = GETSTATE(self);
+	return PyLong_FromLong(apportable_whereis_flags(&(st->apportable), flags));
+}
+
+
+/* progfile(library_name or None) -> str or None */
+static PyObject *
+appoext_progfile (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	apportable_sv library_name;
+	struct module_state *st;
 	char * ret;
 	PyObject * pyres;
 
- 	if (!PyArg_ParseTuple(args, "UUb", &osp, &obin, &execonly)) {
-  		return NULL;
+	if (_appoext_nargs("progfile", nargs, 1, 1) < 0 || _appoext_pyobysv(args[0], &library_name, 1) < 0) {
+		return NULL;
 	}
 	st = GETSTATE(self);
-	searchpath = _appoext_pyobyutf8(self, osp);
-	bin = _appoext_pyobyutf8(self, obin);
 
-	ret = st->apportable.whereis(&(st->apportable), searchpath, bin, execonly);
+	Py_BEGIN_ALLOW_THREADS
+	ret = st->apportable.progfile(&(st->apportable), library_name.p);
+	Py_END_ALLOW_THREADS
 	if (!ret) {
 		Py_RETURN_NONE;
 	}
 	pyres = PyUnicode_FromString(ret);
-	free(ret);
+	apportable_free(&(st->apportable), ret);
 	return pyres;
 }
 
 
+/* pathexp(template, library_path or None) -> str or None */
+static PyObject *
+appoext_pathexp (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	apportable_sv template, library_path;
+	struct module_state *st;
+
+	if (_appoext_nargs("pathexp", nargs, 2, 2) < 0
+			|| _appoext_pyobysv(args[0], &template, 0) < 0 || _appoext_pyobysv(args[1], &library_path, 1) < 0) {
+		return NULL;
+	}
+	st = GETSTATE(self);
+	return _appoext_sv_result(self, apportable_pathexp_sv(&(st->apportable), template, library_path));
+}
+
+
+
+/* progfile_for_address(address) -> str or None */
 static PyObject *
-appoext_progfile (PyObject * self, PyObject * args)
+appoext_progfile_for_address (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
 {
-  const char * library_name;
+	unsigned long long addr;
 	struct module_state *st;
 	char * ret;
 	PyObject * pyres;
 
- 	if (!PyArg_ParseTuple(args, "z", &library_name)) {
-  		return NULL;
+	if (_appoext_nargs("progfile_for_address", nargs, 1, 1) < 0) {
+		return NULL;
+	}
+	/* as "K", without an overflow check */
+	addr = PyLong_AsUnsignedLongLongMask(args[0]);
+	if (addr == (unsigned long long) -1 && PyErr_Occurred()) {
+		return NULL;
 	}
 	st = GETSTATE(self);
-
-	ret = st->apportable.progfile(&(st->apportable), library_name);
-	// pyres = Py_BuildValue("s", ret);
+	if (!(ret = st->apportable.progfile_for_address(&(st->apportable), (const void *) (uintptr_t) addr))) {
+		Py_RETURN_NONE;
+	}
 	pyres = PyUnicode_FromString(ret);
-	free(ret);
+	apportable_free(&(st->apportable), ret);
 	return pyres;
 }
 
 
+/* whereis_sv(searchpath, bin, execonly), pathexp_sv(template, library_path),
+ * env_sv(name) -> str or None; the arguments are bytes-like, slices of a
+ * memoryview included, so they need not be terminated */
 static PyObject *
-appoext_pathexp (PyObject * self, PyObject * args)
+appoext_whereis_sv (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
 {
-	PyObject * ot, * olb;
-	const char * template, * library_path;
+	Py_buffer searchpath, bin;
+	int execonly;
 	struct module_state *st;
-	char * ret;
-	PyObject * pyres;
+	apportable_sv ret;
 
-	if (!PyArg_ParseTuple(args, "UU", &ot, &olb)) {
-    	return NULL;
-  	}
+	if (_appoext_nargs("whereis_sv", nargs, 3, 3) < 0 || _appoext_int(args[2], &execonly) < 0
+			|| _appoext_buffer(args[0], &searchpath, 0) < 0) {
+		return NULL;
+	}
+	if (_appoext_buffer(args[1], &bin, 0) < 0) {
+		PyBuffer_Release(&searchpath);
+		return NULL;
+	}
 	st = GETSTATE(self);
-	template = _appoext_pyobyutf8(self, ot);
-	library_path = _appoext_pyobyutf8(self, olb);
+	ret = apportable_whereis_sv(&(st->apportable), _appoext_buffer_sv(&searchpath), _appoext_buffer_sv(&bin), execonly);
+	PyBuffer_Release(&searchpath);
+	PyBuffer_Release(&bin);
+	return _appoext_sv_result(self, ret);
+}
 
-	ret = st->apportable.pathexp(&(st->apportable), template, library_path);
-	pyres = PyUnicode_FromString(ret);
-	free(ret);
+static PyObject *
+appoext_pathexp_sv (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	Py_buffer template, library_path;
+	struct module_state *st;
+	apportable_sv ret;
+
+	if (_appoext_nargs("pathexp_sv", nargs, 2, 2) < 0 || _appoext_buffer(args[0], &template, 0) < 0) {
+		return NULL;
+	}
+	if (_appoext_buffer(args[1], &library_path, 1) < 0) {
+		PyBuffer_Release(&template);
+		return NULL;
+	}
+	st = GETSTATE(self);
+	ret = apportable_pathexp_sv(&(st->apportable), _appoext_buffer_sv(&template), _appoext_buffer_sv(&library_path));
+	PyBuffer_Release(&template);
+	if (library_path.obj)
+		PyBuffer_Release(&library_path);
+	return _appoext_sv_result(self, ret);
+}
+
+static PyObject *
+appoext_env_sv (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	Py_buffer name;
+	struct module_state *st;
+	apportable_sv sv;
+
+	if (_appoext_nargs("env_sv", nargs, 1, 1) < 0 || _appoext_buffer(args[0], &name, 0) < 0) {
+		return NULL;
+	}
+	st = GETSTATE(self);
+	sv = apportable_env_sv(&(st->snapshot), _appoext_buffer_sv(&name));
+	PyBuffer_Release(&name);
+	if (!sv.p) {
+		Py_RETURN_NONE;
+	}
+	return PyUnicode_FromStringAndSize(sv.p, sv.n);
+}
+
+
+/* stats_enable() -> int, stats_reset(), stats() -> (total, {function: counts}),
+ * each counts a dict as apportable_stats fills it */
+static PyObject *
+appoext_stats_enable (PyObject * self, PyObject * args)
+{
+	struct module_state *st;
+
+	st = GETSTATE(self);
+	return Py_BuildValue("i", apportable_stats_enable(&(st->apportable)));
+}
+
+static PyObject *
+appoext_stats_reset (PyObject * self, PyObject * args)
+{
+	struct module_state *st;
+
+	st = GETSTATE(self);
+	apportable_stats_reset(&(st->apportable));
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+_appoext_stat (const struct apportable_stat * s)
+{
+	return Py_BuildValue("{s:n,s:n,s:n,s:n,s:n,s:n,s:n}",
+			"calls", (Py_ssize_t) s->calls, "allocs", (Py_ssize_t) s->allocs,
+			"frees", (Py_ssize_t) s->frees, "bytes", (Py_ssize_t) s->bytes,
+			"live", (Py_ssize_t) s->live, "peak", (Py_ssize_t) s->peak,
+			"outstanding", (Py_ssize_t) s->outstanding);
+}
+
+static PyObject *
+appoext_stats (PyObject * self, PyObject * args)
+{
+	struct module_state *st;
+	struct apportable_stat total, * fn;
+	size_t n, cap, i;
+	PyObject * fns, * item, * pyres;
+
+	st = GETSTATE(self);
+	memset(&total, 0, sizeof(total));
+	/* room for those that come in meanwhile */
+	cap = apportable_stats(&(st->apportable), NULL, NULL, 0) + 8;
+	if (!(fn = PyMem_Malloc(cap * sizeof(*fn)))) {
+		return PyErr_NoMemory();
+	}
+	if ((n = apportable_stats(&(st->apportable), &total, fn, cap)) > cap)
+		n = cap;
+	pyres = NULL;
+	if (!(fns = PyDict_New()))
+		goto done;
+	for (i = 0; i < n; i++) {
+		if (!(item = _appoext_stat(&fn[i])) || PyDict_SetItemString(fns, fn[i].name, item) < 0) {
+			Py_XDECREF(item);
+			Py_DECREF(fns);
+			goto done;
+		}
+		Py_DECREF(item);
+	}
+	pyres = Py_BuildValue("(NN)", _appoext_stat(&total), fns);
+done:
+	PyMem_Free(fn);
+	return pyres;
+}
+
+
+/* env_refresh() -> int, env(name) -> str or None, on their own state */
+static PyObject *
+appoext_env_refresh (PyObject * self, PyObject * args)
+{
+	struct module_state *st;
+
+	st = GETSTATE(self);
+	return Py_BuildValue("i", apportable_env_refresh(&(st->snapshot)));
+}
+
+static PyObject *
+appoext_env (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	const char * name;
+	Py_ssize_t name_l;
+	struct module_state *st;
+	apportable_sv val;
+
+	if (_appoext_nargs("env", nargs, 1, 1) < 0 || !(name = _appoext_pyobyutf8(args[0], &name_l))) {
+		return NULL;
+	}
+	st = GETSTATE(self);
+	val = apportable_env(&(st->snapshot), name);
+	if (!val.p) {
+		Py_RETURN_NONE;
+	}
+	return PyUnicode_FromStringAndSize(val.p, val.n);
+}
+
+
+/* exepath() and origin() -> str, from the snapshot */
+static PyObject *
+appoext_exepath (PyObject * self, PyObject * args)
+{
+	struct module_state *st;
+	const char * ret;
+	size_t ret_l;
+
+	st = GETSTATE(self);
+	if (!(ret = apportable_exepath(&(st->apportable), &ret_l))) {
+		Py_RETURN_NONE;
+	}
+	return PyUnicode_FromStringAndSize(ret, ret_l);
+}
+
+static PyObject *
+appoext_origin (PyObject * self, PyObject * args)
+{
+	struct module_state *st;
+	const char * ret;
+	size_t ret_l;
+
+	st = GETSTATE(self);
+	if (!(ret = apportable_origin(&(st->apportable), &ret_l))) {
+		Py_RETURN_NONE;
+	}
+	return PyUnicode_FromStringAndSize(ret, ret_l);
+}
+
+
+/* dirs() -> {name: str}, the relocated installation directories */
+static PyObject *
+appoext_dirs (PyObject * self, PyObject * args)
+{
+	static const char * const names[] = {"prefix", "exec_prefix", "bindir", "sbindir", "libexecdir",
+		"sysconfdir", "sharedstatedir", "localstatedir", "runstatedir", "libdir", "includedir",
+		"datarootdir", "datadir", "localedir", "mandir", "docdir"};
+	struct module_state *st;
+	const struct apportable_dirs * dirs;
+	const apportable_sv * sv;
+	PyObject * pyres, * item;
+	size_t i;
+
+	st = GETSTATE(self);
+	if (!(dirs = apportable_dirs(&(st->apportable)))) {
+		Py_RETURN_NONE;
+	}
+	if (!(pyres = PyDict_New()))
+		return NULL;
+	for (i = 0, sv = &dirs->prefix; i < sizeof(names) / sizeof(*names); i++, sv++) {
+		if (!(item = PyUnicode_FromStringAndSize(sv->p, sv->n)) || PyDict_SetItemString(pyres, names[i], item) < 0) {
+			Py_XDECREF(item);
+			Py_DECREF(pyres);
+			return NULL;
+		}
+		Py_DECREF(item);
+	}
 	return pyres;
 }
 
 
+/* template(template) -> str, resolved once on the global state */
+static PyObject *
+appoext_template (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	const char * template;
+	Py_ssize_t template_l;
+
+	if (_appoext_nargs("template", nargs, 1, 1) < 0 || !(template = _appoext_pyobyutf8(args[0], &template_l))) {
+		return NULL;
+	}
+	return PyUnicode_FromString(apportable_template(template));
+}
+
+
+/* template_expand(template, library_path or None) -> str */
+static PyObject *
+appoext_template_expand (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	apportable_sv template, library_path;
+	struct module_state *st;
+	struct apportable_tmpl * t;
+	apportable_sv ret;
+
+	library_path.p = NULL;
+	library_path.n = 0;
+	if (_appoext_nargs("template_expand", nargs, 1, 2) < 0 || _appoext_pyobysv(args[0], &template, 0) < 0
+			|| (nargs > 1 && _appoext_pyobysv(args[1], &library_path, 1) < 0)) {
+		return NULL;
+	}
+	st = GETSTATE(self);
 
+	if (!(t = apportable_template_compile_sv(&(st->apportable), template))) {
+		return PyErr_NoMemory();
+	}
+	ret = apportable_template_expand_sv(&(st->apportable), t, library_path);
+	apportable_template_free(&(st->apportable), t);
+	return _appoext_sv_result(self, ret);
+}
+
+
+
+/* pathexp_into(template, library_path, cap) -> (result or None, needed) */
 static PyObject *
-appoext_ugetenv (PyObject * self, PyObject * args)
+appoext_pathexp_into (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
 {
+	apportable_sv template, library_path;
+	Py_ssize_t cap;
 	struct module_state *st;
-	PyObject * oenv;
-	char * env;
+	char * buf, * ret;
+	size_t needed;
+	PyObject * pyres;
+
+	if (_appoext_nargs("pathexp_into", nargs, 3, 3) < 0 || _appoext_pyobysv(args[0], &template, 0) < 0
+			|| _appoext_pyobysv(args[1], &library_path, 0) < 0 || _appoext_ssize(args[2], &cap) < 0) {
+		return NULL;
+	}
+	st = GETSTATE(self);
+
+	buf = cap > 0 ? PyMem_Malloc(cap) : NULL;
+	ret = st->apportable.pathexp_into(&(st->apportable), template.p, library_path.p, buf, cap, &needed);
+	if (ret)
+		/* needed counts the terminator */
+		pyres = Py_BuildValue("(Nn)", PyUnicode_FromStringAndSize(ret, needed - 1), (Py_ssize_t) needed);
+	else
+		pyres = Py_BuildValue("(On)", Py_None, (Py_ssize_t) needed);
+	PyMem_Free(buf);
+	return pyres;
+}
+
+static PyObject *
+appoext_ugetenv (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	struct module_state *st;
+	const char * env;
+	Py_ssize_t env_l;
 	char * ret;
 	PyObject * pyres;
 
- 	if (!PyArg_ParseTuple(args, "U", &oenv)) {
-  		return NULL;
+	if (_appoext_nargs("ugetenv", nargs, 1, 1) < 0 || !(env = _appoext_pyobyutf8(args[0], &env_l))) {
+		return NULL;
 	}
 	st = GETSTATE(self);
-	env = _appoext_pyobyutf8(self, oenv);
 
-	ret = st->apportable.ugetenv(&(st->apportable), env);
+	/* read only, whatever the prototype says */
+	ret = st->apportable.ugetenv(&(st->apportable), (char *) env);
 	if (!ret) {
 		Py_RETURN_NONE;
 	}
 	pyres = PyUnicode_FromString(ret);
-	free(ret);
+	apportable_free(&(st->apportable), ret);
 	return pyres;
 }
 
 
 static PyObject *
-appoext_wugetenv (PyObject * self, PyObject * args)
+appoext_wugetenv (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
 {
 	struct module_state *st;
-	PyObject * oenv;
 	wchar_t * env;
 	char * ret;
 	PyObject * pyres;
 
- 	if (!PyArg_ParseTuple(args, "U", &oenv)) {
-  		return NULL;
+	if (_appoext_nargs("wugetenv", nargs, 1, 1) < 0) {
+		return NULL;
+	}
+	if (!PyUnicode_Check(args[0])) {
+		PyErr_SetString(PyExc_TypeError, "wugetenv() argument must be str");
+		return NULL;
 	}
 	st = GETSTATE(self);
-	env = _appoext_pyobywstr(self, oenv);
+	if (!(env = _appoext_pyobywstr(self, args[0])))
+		return NULL;
 
 	ret = st->apportable.wugetenv(&(st->apportable), env);
+	PyMem_Free(env);
 	if (!ret) {
 		Py_RETURN_NONE;
 	}
 	pyres = PyUnicode_FromString(ret);
-	free(ret);
+	apportable_free(&(st->apportable), ret);
 	return pyres;
 }
 
 
 
 
+/* stress_init(threads, rounds) -> failures: first use of a fresh state
+ * from many threads at once, each checking it sees a complete state */
+struct appoext_stress {
+	apportable_t * state;
+	PyThread_type_lock lock, gate, finished;
+	int expected, done, failures;
+};
+
+static void
+_appoext_stress_run (void * arg)
+{
+	struct appoext_stress * stress = arg;
+	apportable_t * st;
+	char * ret;
+	int failed, last;
+
+	/* held by the caller until every thread is waiting here */
+	PyThread_acquire_lock(stress->gate, 1);
+	PyThread_release_lock(stress->gate);
+
+	st = apportable_getstate(stress->state);
+	failed = st != stress->state || !st->_strndup || !st->whereis || !st->template_expand_into;
+	if (!failed) {
+		ret = st->_strndup(st, "apportable", 0);
+		failed = !ret || strcmp(ret, "apportable");
+		apportable_free(st, ret);
+		/* undone if apportable_init ran again after this */
+		apportable_whereis_flags(st, APPORTABLE_WHEREIS_INDEX);
+	}
+	PyThread_acquire_lock(stress->lock, 1);
+	stress->failures += failed;
+	last = ++stress->done == stress->expected;
+	PyThread_release_lock(stress->lock);
+	if (last)
+		PyThread_release_lock(stress->finished);
+}
+
+static PyObject *
+appoext_stress_init (PyObject * self, PyObject * const * args, Py_ssize_t nargs)
+{
+	struct appoext_stress stress;
+	int threads, rounds, round, n;
+
+	if (_appoext_nargs("stress_init", nargs, 2, 2) < 0
+			|| _appoext_int(args[0], &threads) < 0 || _appoext_int(args[1], &rounds) < 0) {
+		return NULL;
+	}
+	stress.lock = PyThread_allocate_lock();
+	stress.gate = PyThread_allocate_lock();
+	stress.finished = PyThread_allocate_lock();
+	if (!stress.lock || !stress.gate || !stress.finished) {
+		PyErr_NoMemory();
+		goto done;
+	}
+	stress.failures = 0;
+	Py_BEGIN_ALLOW_THREADS
+	for (round = 0; round < rounds; round++) {
+		if (!(stress.state = calloc(1, sizeof(apportable_t)))) {
+			stress.failures++;
+			break;
+		}
+		PyThread_acquire_lock(stress.gate, 1);
+		PyThread_acquire_lock(stress.finished, 1);
+		stress.done = 0;
+		stress.expected = threads;   /* nobody is past the gate yet */
+		for (n = 0; n < threads; n++)
+			if (PyThread_start_new_thread(_appoext_stress_run, &stress) == (unsigned long) -1)
+				break;
+		stress.failures += threads - n;
+		stress.expected = n;
+		PyThread_release_lock(stress.gate);
+		if (n)
+			PyThread_acquire_lock(stress.finished, 1);
+		PyThread_release_lock(stress.finished);
+		if (n && stress.state->_whereis_flags != APPORTABLE_WHEREIS_INDEX)
+			stress.failures++;
+		apportable_fini(stress.state);
+		free(stress.state);
+	}
+	Py_END_ALLOW_THREADS
+done:
+	if (stress.lock)
+		PyThread_free_lock(stress.lock);
+	if (stress.gate)
+		PyThread_free_lock(stress.gate);
+	if (stress.finished)
+		PyThread_free_lock(stress.finished);
+	if (PyErr_Occurred())
+		return NULL;
+	return Py_BuildValue("i", stress.failures);
+}
+
+
+/* METH_FASTCALL from Python 3.7; before that, METH_VARARGS with a shim
+ * that hands the function the tuple's items */
+#if PY_VERSION_HEX >= 0x03070000
+# define APPOEXT_METHOD(name) {#name, (PyCFunction) (void (*) (void)) appoext_##name, METH_FASTCALL, NULL}
+#else
+# define APPOEXT_METHOD(name) {#name, appoext_##name##_shim, METH_VARARGS, NULL}
+# define APPOEXT_SHIM(name) \
+	static PyObject * \
+	appoext_##name##_shim (PyObject * self, PyObject * args) \
+	{ \
+		return _appoext_shim(self, args, appoext_##name); \
+	}
+
+static PyObject *
+_appoext_shim (PyObject * self, PyObject * args, PyObject * (*fn) (PyObject *, PyObject * const *, Py_ssize_t))
+{
+#if PY_VERSION_HEX < 0x03030000
+	PyObject * dict, * keep, * outer, * ret;
+
+	/* a list of its own for each call, nested ones included */
+	if (!(dict = PyThreadState_GetDict())) {
+		PyErr_SetString(PyExc_SystemError, "no thread state dict");
+		return NULL;
+	}
+	if (!(keep = PyList_New(0)))
+		return NULL;
+	outer = PyDict_GetItemString(dict, APPOEXT_KEEP);
+	Py_XINCREF(outer);
+	if (PyDict_SetItemString(dict, APPOEXT_KEEP, keep) < 0)
+		ret = NULL;
+	else
+		ret = fn(self, &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args));
+	if (outer)
+		PyDict_SetItemString(dict, APPOEXT_KEEP, outer);
+	else if (PyDict_GetItemString(dict, APPOEXT_KEEP))
+		PyDict_DelItemString(dict, APPOEXT_KEEP);
+	Py_XDECREF(outer);
+	Py_DECREF(keep);
+	return ret;
+#else
+	return fn(self, &PyTuple_GET_ITEM(args, 0), PyTuple_GET_SIZE(args));
+#endif
+}
+
+APPOEXT_SHIM(strndup)
+APPOEXT_SHIM(wcsndup)
+APPOEXT_SHIM(wutf8)
+APPOEXT_SHIM(uwchar_t)
+APPOEXT_SHIM(progfile)
+APPOEXT_SHIM(progfile_for_address)
+APPOEXT_SHIM(pathexp)
+APPOEXT_SHIM(pathexp_into)
+APPOEXT_SHIM(pathexp_sv)
+APPOEXT_SHIM(template_expand)
+APPOEXT_SHIM(template)
+APPOEXT_SHIM(stress_init)
+APPOEXT_SHIM(whereis)
+APPOEXT_SHIM(whereis_many)
+APPOEXT_SHIM(pathexp_many)
+APPOEXT_SHIM(progfile_many)
+APPOEXT_SHIM(whereis_sv)
+APPOEXT_SHIM(whereis_flags)
+APPOEXT_SHIM(ugetenv)
+APPOEXT_SHIM(wugetenv)
+APPOEXT_SHIM(env)
+APPOEXT_SHIM(env_sv)
+#endif
+
 static PyMethodDef apportable_methods[] = {
-	{"selftest", appoext_selftest, METH_VARARGS, NULL},
-	{"strndup", appoext_strndup, METH_VARARGS, NULL},
-	{"wcsndup", appoext_wcsndup, METH_VARARGS, NULL},
-	{"wutf8", appoext_wutf8, METH_VARARGS, NULL},
-	{"uwchar_t", appoext_uwchar_t, METH_VARARGS, NULL},
-    {"progfile", appoext_progfile, METH_VARARGS, NULL},
-    {"pathexp", appoext_pathexp, METH_VARARGS, NULL},
-    {"whereis", appoext_whereis, METH_VARARGS, NULL},
-    {"ugetenv", appoext_ugetenv, METH_VARARGS, NULL},
-    {"wugetenv", appoext_wugetenv, METH_VARARGS, NULL},
-    { NULL, NULL, 0, NULL }
+	{"selftest", appoext_selftest, METH_NOARGS, NULL},
+	APPOEXT_METHOD(strndup),
+	APPOEXT_METHOD(wcsndup),
+	APPOEXT_METHOD(wutf8),
+	APPOEXT_METHOD(uwchar_t),
+	APPOEXT_METHOD(progfile),
+	APPOEXT_METHOD(progfile_for_address),
+	APPOEXT_METHOD(pathexp),
+	APPOEXT_METHOD(pathexp_into),
+	APPOEXT_METHOD(pathexp_sv),
+	APPOEXT_METHOD(template_expand),
+	APPOEXT_METHOD(template),
+	APPOEXT_METHOD(stress_init),
+	APPOEXT_METHOD(whereis),
+	APPOEXT_METHOD(whereis_many),
+	APPOEXT_METHOD(pathexp_many),
+	APPOEXT_METHOD(progfile_many),
+	APPOEXT_METHOD(whereis_sv),
+	APPOEXT_METHOD(whereis_flags),
+	APPOEXT_METHOD(ugetenv),
+	APPOEXT_METHOD(wugetenv),
+	APPOEXT_METHOD(env),
+	APPOEXT_METHOD(env_sv),
+	{"exepath", appoext_exepath, METH_NOARGS, NULL},
+	{"origin", appoext_origin, METH_NOARGS, NULL},
+	{"dirs", appoext_dirs, METH_NOARGS, NULL},
+	{"stats_enable", appoext_stats_enable, METH_NOARGS, NULL},
+	{"stats_reset", appoext_stats_reset, METH_NOARGS, NULL},
+	{"stats", appoext_stats, METH_NOARGS, NULL},
+	{"env_refresh", appoext_env_refresh, METH_NOARGS, NULL},
+	{ NULL, NULL, 0, NULL }
 };
 
 
@@ -418,6 +1369,10 @@ init_apportable(void)
     INITERROR;
   st = GETSTATE(module);
   apportable_init(&(st->apportable), 1);
+  apportable_init(&(st->snapshot), 1);
+  PyModule_AddIntConstant(module, "WHEREIS_INDEX", APPORTABLE_WHEREIS_INDEX);
+  PyModule_AddIntConstant(module, "WHEREIS_DIRFD", APPORTABLE_WHEREIS_DIRFD);
+  PyModule_AddIntConstant(module, "WHEREIS_URING", APPORTABLE_WHEREIS_URING);
 
   st->error = PyErr_NewException("apportable.ApportableError", NULL, NULL);
   if (st->error == NULL) {
@@ -1,17 +1,28 @@
 
+import os
 import sys
+import sysconfig
 
 from setuptools import setup, Extension
 
-if sys.platform != 'win32':
+if sys.platform != 'win32' and not sys.platform.startswith('linux'):
+	# glibc carries iconv in libc itself
 	ext_libs = ['iconv']
 else:
 	ext_libs = []
 
+ext_macros = [('APPORTABLE', '1')]
+# $LIB in templates: lib/<triplet> where Python has one (Debian)
+if sys.platform.startswith('linux') and sysconfig.get_config_var('MULTIARCH'):
+	ext_macros.append(('APPORTABLE_MULTIARCH', '"%s"' % sysconfig.get_config_var('MULTIARCH')))
+if os.environ.get('APPORTABLE_STATS'):
+	# allocation statistics, for test_stats; GCC and Clang only
+	ext_macros.append(('APPORTABLE_STATS', '1'))
+
 
 _apportable = Extension(
 		'_apportable',
-		define_macros = [('APPORTABLE', '1')],
+		define_macros = ext_macros,
 		libraries = [] + ext_libs,
         sources = ['apportable.c', 'apportable_pyext.c']
 	)
@@ -11,6 +11,7 @@ except:
 import sys
 import os
 import subprocess
+import sysconfig
 
 import unittest
 
@@ -25,11 +26,13 @@ class TestClass(unittest.TestCase):
 
 	t1 = u"abcde"
 	t2 = u"äβ©☃☂"
+	t3 = u"/usr/local/share/apportable/etc/apportable.conf/" * 3
+	t4 = u"/usr/local/äβ©/share/☃☂/\U0001F600/apportable/etc/apportable.conf/" * 2
 
 	def test_strndup(self):
 		a = apportable
 
-		for t in (self.t1, self.t2):
+		for t in (self.t1, self.t2, self.t3, self.t4):
 			self.assertEqual( a.strndup(t, 0), t )
 			for x in range(1, len(t)+1):
 				# self.assertEqual( repr(a.strndup(t, x)), repr(t[0:x]) )
@@ -38,7 +41,7 @@ class TestClass(unittest.TestCase):
 	def test_wcsndup(self):
 		a = apportable
 
-		for t in (self.t1, self.t2):
+		for t in (self.t1, self.t2, self.t3, self.t4):
 			self.assertEqual( a.wcsndup(t, 0), t )
 			for x in range(1, len(t)+1):
 				self.assertEqual( a.wcsndup(t, x), t[0:x] )
@@ -46,13 +49,13 @@ class TestClass(unittest.TestCase):
 	def test_wutf8(self):
 		a = apportable
 
-		for t in (self.t1, self.t2):
+		for t in (self.t1, self.t2, self.t3, self.t4):
 			self.assertEqual( a.wutf8(t), t)
 
 	def test_uwchar_t(self):
 		a = apportable
 
-		for t in (self.t1, self.t2):
+		for t in (self.t1, self.t2, self.t3, self.t4):
 			self.assertEqual( a.uwchar_t(t), t)
 
 	def test_whereis(self):
@@ -67,6 +70,51 @@ class TestClass(unittest.TestCase):
 		self.assertEqual(a.whereis(u"::::",  u"hosts", 0), "hosts")
 		self.assertEqual(a.whereis(u"",  u"hosts", 0), "hosts")
 
+	def test_whereis_many(self):
+		a = apportable
+
+		pth = unicode(os.environ.get("PATH", "/usr/bin:/bin"))
+		names = [u"sh", u"nonexistent-apportable", u"ls", u"env", u"sh", u"", u"bin/sh"]
+		for x in (0, 1):
+			self.assertEqual(a.whereis_many(pth, names, x), [a.whereis(pth, n, x) for n in names])
+		self.assertEqual(a.whereis_many(u"/opt:/etc:/", [u"hosts", u"etc", u"x"], 0), [u"/etc/hosts", u"//etc", u"x"])
+		self.assertEqual(a.whereis_many(pth, [], 1), [])
+		# enough for the pool, if there is one; a tuple does as well
+		names = tuple(names * 20)
+		self.assertEqual(a.whereis_many(pth, names, 1), [a.whereis(pth, n, 1) for n in names])
+
+	def test_many(self):
+		a = apportable
+
+		ts = [u"$ORIGIN/../lib/t%d" % i for i in range(5000)] + [u"/etc/x.conf", u""]
+		for lib in (u"/some/fixed/pgm", None):
+			self.assertEqual(a.pathexp_many(ts, lib), [a.pathexp(t, lib) for t in ts])
+		names = [None, os.path.basename(a.progfile(None)), u"nonexistent-apportable"] * 50
+		self.assertEqual(a.progfile_many(names), [a.progfile(n) for n in names])
+		self.assertEqual(a.pathexp_many([], None), [])
+		self.assertRaises(TypeError, a.pathexp_many, [u"$ORIGIN", None], None)
+		self.assertRaises(TypeError, a.progfile_many, None)
+
+	def test_whereis_flags(self):
+		a = apportable
+
+		pth = unicode(os.environ.get("PATH", "/usr/bin:/bin"))
+		names = (u"sh", u"ls", u"env", u"nonexistent-apportable", u"..", u".")
+		plain = [a.whereis(pth, n, x) for n in names for x in (0, 1)]
+		for flags in (a.WHEREIS_INDEX, a.WHEREIS_DIRFD, a.WHEREIS_INDEX | a.WHEREIS_DIRFD,
+				a.WHEREIS_URING, a.WHEREIS_URING | a.WHEREIS_INDEX):
+			self.assertEqual(a.whereis_flags(flags), 0)
+			try:
+				for i in range(2):
+					self.assertEqual([a.whereis(pth, n, x) for n in names for x in (0, 1)], plain)
+				self.assertEqual(a.whereis(u"/opt:/etc",  u"hosts", 0), "/etc/hosts")
+				self.assertEqual(a.whereis(u"::::",  u"hosts", 0), "hosts")
+				self.assertEqual(a.whereis(u"/nonexistent-apportable:/etc",  u"hosts", 0), "/etc/hosts")
+				self.assertEqual(a.whereis(u"/opt:/etc",  u"/etc/hosts", 0), "/etc/hosts")
+				self.assertEqual(a.whereis_many(u"/opt:/etc", [u"/etc/hosts"], 0), ["/etc/hosts"])
+			finally:
+				self.assertEqual(a.whereis_flags(0), flags)
+
 	def test_pathexp(self):
 		a = apportable
 
@@ -84,6 +132,167 @@ class TestClass(unittest.TestCase):
 		self.assertEqual(a.pathexp(t3, b), r3)
 		self.assertEqual(a.pathexp(u"", u""), u"")
 
+	def test_pathexp_into(self):
+		a = apportable
+
+		b = u"/some/fixed/pgm"
+		t1 = u"$ORIGIN/../variable/path"
+		r = u"/some/fixed/../variable/path"
+		n = len(r.encode('utf-8')) + 1
+
+		self.assertEqual(a.pathexp_into(t1, b, 0), (None, n))
+		self.assertEqual(a.pathexp_into(t1, b, n - 1), (None, n))
+		self.assertEqual(a.pathexp_into(t1, b, n), (r, n))
+		self.assertEqual(a.pathexp_into(t1, b, 4096), (r, n))
+
+	def test_template_expand(self):
+		a = apportable
+
+		b = u"/some/fixed/pgm"
+		self.assertEqual(a.template_expand(u"$ORIGIN/../etc/x.conf", b), u"/some/fixed/../etc/x.conf")
+		self.assertEqual(a.template_expand(u"${ORIGIN}/a:$ORIGIN/b", b), u"/some/fixed/a:/some/fixed/b")
+		self.assertEqual(a.template_expand(u"/x/$ORIGIN", b), u"/x//some/fixed")
+		self.assertEqual(a.template_expand(u"$ORIGIN/a", u"/pgm"), u"/a")
+		self.assertEqual(a.template_expand(u"$ORIGIN/a", u"pgm"), u"./a")
+		self.assertEqual(a.template_expand(u"$ORIGINAL $FOO ${FOO} ${ENV:} $ ${", b), u"$ORIGINAL $FOO ${FOO} ${ENV:} $ ${")
+		self.assertEqual(a.template_expand(u"", b), u"")
+		multiarch = sys.platform.startswith("linux") and sysconfig.get_config_var("MULTIARCH")
+		if multiarch:
+			self.assertEqual(a.template_expand(u"/usr/$LIB", b), u"/usr/lib/" + multiarch)
+		else:
+			self.assertIn(a.template_expand(u"/usr/$LIB", b), (u"/usr/lib", u"/usr/lib64"))
+		self.assertEqual(a.template_expand(u"$LIB", b), a.template_expand(u"${LIB}", b))
+		if sys.platform.startswith("linux"):
+			self.assertEqual(a.template_expand(u"$PLATFORM", b), os.uname()[4])
+		os.environ["APPORTABLE_T"] = u"äβ"
+		self.assertEqual(a.template_expand(u"<${ENV:APPORTABLE_T}${ENV:APPORTABLE_NONE}>", b), u"<äβ>")
+		del os.environ["APPORTABLE_T"]
+		prog = a.progfile(None)
+		self.assertEqual(a.template_expand(u"$ORIGIN/x"), os.path.dirname(prog) + u"/x")
+
+	def test_progfile_for_address(self):
+		import ctypes, ctypes.util
+		a = apportable
+
+		name = ctypes.util.find_library("m")
+		if name is None or sys.platform == "win32":
+			self.skipTest("no libm")
+		libm = ctypes.CDLL(name)
+		addr = ctypes.cast(libm.cos, ctypes.c_void_p).value
+		path = a.progfile_for_address(addr)
+		self.assertTrue(os.path.basename(path).startswith("libm"), path)
+		self.assertEqual(a.progfile(os.path.basename(path)), path)
+		self.assertEqual(a.progfile_for_address(addr + 1), path)
+		self.assertEqual(a.progfile_for_address(0), None)
+		self.assertEqual(a.progfile_for_address(16), None)
+
+	def test_exepath(self):
+		a = apportable
+
+		prog = a.progfile(None)
+		self.assertEqual(a.exepath(), prog)
+		self.assertEqual(a.origin(), os.path.dirname(prog))
+		self.assertEqual(a.pathexp(u"$ORIGIN/x", None), os.path.dirname(prog) + u"/x")
+
+	def test_dirs(self):
+		a = apportable
+
+		d = a.dirs()
+		origin = a.origin()
+		if os.path.basename(origin) in ("bin", "sbin", "lib", "lib64", "libexec"):
+			prefix = os.path.dirname(origin)
+		else:
+			prefix = origin
+		self.assertEqual(d["prefix"], prefix)
+		self.assertEqual(d["exec_prefix"], prefix)
+		self.assertEqual(d["bindir"], os.path.join(prefix, "bin"))
+		self.assertEqual(d["sysconfdir"], os.path.join(prefix, "etc"))
+		self.assertEqual(d["runstatedir"], os.path.join(prefix, "var", "run"))
+		self.assertEqual(d["localedir"], os.path.join(prefix, "share", "locale"))
+		self.assertEqual(len(d), 16)
+		self.assertEqual(a.dirs(), d)
+
+	def test_sv(self):
+		a = apportable
+
+		# slices of one buffer, none of them terminated
+		m = memoryview(b"/opt:/etc|hosts|$ORIGIN/../x|/some/fixed/pgm|PATH|")
+		path, bin, t, lib, var = m[0:9], m[10:15], m[16:28], m[29:44], m[45:49]
+		self.assertEqual(a.whereis_sv(path, bin, 0), u"/etc/hosts")
+		self.assertEqual(a.whereis_sv(path, bin, 1), a.whereis(u"/opt:/etc", u"hosts", 1))
+		self.assertEqual(a.whereis_sv(path[0:4], bin, 0), u"hosts")
+		self.assertEqual(a.whereis_sv(path, bin[0:4], 0), u"host")
+		self.assertEqual(a.whereis_sv(path, b"hosts\0x", 0), None)
+		self.assertEqual(a.pathexp_sv(t, lib), u"/some/fixed/../x")
+		self.assertEqual(a.pathexp_sv(t[0:7], lib[0:6]), u"/some/")
+		self.assertEqual(a.pathexp_sv(t[1:], lib), u"ORIGIN/../x")
+		self.assertEqual(a.pathexp_sv(t, None), a.origin() + u"/../x")
+		self.assertEqual(a.env_sv(var), os.environ.get("PATH"))
+		self.assertEqual(a.env_sv(var[0:3]), os.environ.get("PAT"))
+
+	def test_arguments(self):
+		a = apportable
+
+		self.assertRaises(TypeError, a.pathexp, u"$ORIGIN")
+		self.assertRaises(TypeError, a.pathexp, b"$ORIGIN", None)
+		self.assertRaises(TypeError, a.template_expand)
+		self.assertRaises(TypeError, a.strndup, u"abc", u"1")
+		self.assertRaises(TypeError, a.whereis_sv, b"/etc", u"hosts", 0)
+		self.assertRaises(ValueError, a.pathexp, u"$ORIGIN\0/x", None)
+		self.assertRaises(OverflowError, a.whereis_flags, 1 << 40)
+		self.assertEqual(a.pathexp(u"$ORIGIN/\u00e4", u"/\u00e4/pgm"), u"/\u00e4/\u00e4")
+		self.assertEqual(a.template_expand(u"$ORIGIN/x", None), a.template_expand(u"$ORIGIN/x"))
+		self.assertEqual(a.strndup(u"hello", 3), u"hel")
+
+	def test_stats(self):
+		a = apportable
+
+		if a.stats_enable() != 0:
+			self.skipTest("built without APPORTABLE_STATS")
+		pth = unicode(os.environ.get("PATH", "/usr/bin:/bin"))
+		def load():
+			for i in range(200):
+				a.whereis(pth, u"sh", 1)
+				a.pathexp(u"$ORIGIN/../etc", u"/some/fixed/pgm")
+				a.wutf8(self.t4)
+		load()
+		a.stats_reset()
+		total, fns = a.stats()
+		live = total["live"]
+		for i in range(3):
+			load()
+		total, fns = a.stats()
+		# results all given back, caches already there: flat
+		self.assertEqual(total["live"], live)
+		self.assertEqual(total["allocs"], total["frees"])
+		self.assertEqual(fns["apportable_pathexp_sv"]["calls"], 600)
+		self.assertEqual(fns["apportable_pathexp_sv"]["allocs"], 600)
+		self.assertEqual(fns["apportable_pathexp_sv"]["outstanding"], 0)
+		self.assertEqual(fns["apportable_whereis_sv"]["calls"], 600)
+		self.assertGreater(fns["apportable_wutf8"]["bytes"], 600 * len(self.t4))
+
+		# thousands live at once, of scattered sizes, all given back
+		a.stats_reset()
+		ts = [u"/" + u"x" * (i * 37 % 500) for i in range(3000)]
+		self.assertEqual(len(a.pathexp_many(ts, None)), 3000)
+		total, fns = a.stats()
+		self.assertEqual(fns["apportable_pathexp"]["allocs"], 3000)
+		self.assertEqual(fns["apportable_pathexp"]["outstanding"], 0)
+		self.assertEqual(fns["apportable_pathexp"]["live"], 0)
+
+	def test_template(self):
+		a = apportable
+
+		ts = [u"$ORIGIN/../etc/t%d.conf" % i for i in range(100)] + [u"/etc/x.conf", u""]
+		for i in range(2):
+			for t in ts:
+				self.assertEqual(a.template(t), a.template_expand(t))
+
+	def test_stress_init(self):
+		a = apportable
+
+		self.assertEqual(a.stress_init(64, 20), 0)
+
 	def test_ugetenv(self):
 		a = apportable
 
@@ -93,6 +302,22 @@ class TestClass(unittest.TestCase):
 			self.assertEqual( F(u"NONEXISTENT"), u"")
 
 
+	def test_env(self):
+		a = apportable
+
+		os.environ["APPORTABLE_E"] = u"äβ"
+		self.assertEqual(a.env(u"APPORTABLE_E"), u"äβ")
+		self.assertEqual(a.env_refresh(), 0)
+		os.environ["APPORTABLE_E"] = u"changed"
+		self.assertEqual(a.env(u"APPORTABLE_E"), u"äβ")
+		self.assertEqual(a.env(u"PATH"), os.environ.get("PATH"))
+		self.assertEqual(a.env(u"APPORTABLE_NONE"), None)
+		self.assertEqual(a.env_refresh(), 0)
+		self.assertEqual(a.env(u"APPORTABLE_E"), u"changed")
+		del os.environ["APPORTABLE_E"]
+		self.assertEqual(a.env_refresh(), 0)
+		self.assertEqual(a.env(u"APPORTABLE_E"), None)
+
 
 	# def test_idea(self):
 